@@ -261,6 +261,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/pbkdf2.h \
     src/serialize.h \
     src/support/cleanse.h \
+    src/coins.h \
+    src/checkqueue.h \
     src/core.h \
     src/main.h \
     src/miner.h \
@@ -385,6 +387,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/key.cpp \
     src/pubkey.cpp \
     src/scrypt.cpp \
+    src/coins.cpp \
     src/core.cpp \
     src/main.cpp \
     src/miner.cpp \
@@ -241,6 +241,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/random.h \
     src/serialize.h \
     src/support/cleanse.h \
+    src/coins.h \
+    src/checkqueue.h \
     src/core.h \
     src/main.h \
     src/miner.h \
@@ -366,6 +368,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/random.h \
     src/script.cpp \
     src/scrypt.cpp \
+    src/coins.cpp \
     src/core.cpp \
     src/main.cpp \
     src/miner.cpp \
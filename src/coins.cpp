@@ -0,0 +1,316 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+
+CCoinsViewCache *pcoinsTip = NULL;
+CTransactionCache *ptxCache = NULL;
+
+void CCoins::ToTransaction(const uint256& hash, CTransaction& tx) const
+{
+    tx.SetNull();
+    tx.nVersion = nTxVersion;
+    tx.nTime = nTime;
+    if (IsCoinBase())
+        tx.vin.push_back(CTxIn());
+    else
+        tx.vin.push_back(CTxIn(COutPoint(0, 0)));
+    tx.vout = vout;
+    tx.CacheHash(hash);
+}
+
+CCoinsViewCache::CCoinsViewCache(size_t nMaxUsageIn)
+{
+    nCachedUsage = 0;
+    nMaxUsage = nMaxUsageIn;
+    nHits = 0;
+    nDbReads = 0;
+    nRebuilds = 0;
+}
+
+size_t CCoinsViewCache::EntryUsage(const CCacheEntry& entry)
+{
+    // key, entry and the bucket node pointers
+    return sizeof(uint256) + sizeof(CCacheEntry) + 2 * sizeof(void*) + entry.coins.DynamicMemoryUsage();
+}
+
+void CCoinsViewCache::Store(const uint256& hash, const CCoins& coins, bool fDirty)
+{
+    CoinsMap::iterator it = mapCoins.find(hash);
+    if (it != mapCoins.end())
+    {
+        nCachedUsage -= EntryUsage(it->second);
+        fDirty |= it->second.fDirty;
+    }
+    else
+        it = mapCoins.insert(make_pair(hash, CCacheEntry())).first;
+
+    CCacheEntry& entry = it->second;
+    entry.coins = coins;
+    entry.fDirty = fDirty;
+    entry.fErased = false;
+    nCachedUsage += EntryUsage(entry);
+}
+
+bool CCoinsViewCache::GetCoins(CTxDB& txdb, const uint256& hash, const CTxIndex& txindex, CCoins& coins)
+{
+    LOCK(cs);
+
+    CoinsMap::iterator it = mapCoins.find(hash);
+    if (it != mapCoins.end() && !it->second.fErased && it->second.coins.pos == txindex.pos)
+    {
+        nHits++;
+        coins = it->second.coins;
+        return true;
+    }
+
+    if ((it == mapCoins.end() || !it->second.fErased) && txdb.ReadCoins(hash, coins) && coins.pos == txindex.pos)
+    {
+        nDbReads++;
+        Store(hash, coins, false);
+        return true;
+    }
+
+    // No usable record, rebuild it from the block files. The block header
+    // supplies the confirmation time and, through the block index, the height.
+    CTransaction tx;
+    if (!ptxCache || !ptxCache->Get(hash, txindex.pos, tx))
+    {
+        if (!tx.ReadFromDisk(txindex.pos))
+            return false;
+        if (ptxCache)
+            ptxCache->Add(hash, txindex.pos, tx);
+    }
+    if (tx.GetHash() != hash)
+        return error("CCoinsViewCache::GetCoins() : %s found %s at its index position", hash.ToString(), tx.GetHash().ToString());
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+    if (mi == mapBlockIndex.end())
+        return false;
+
+    nRebuilds++;
+    coins = CCoins(tx, txindex.pos, mi->second->nHeight, block.GetBlockTime());
+
+    // A transaction with nothing left to spend only needs its record for the
+    // moment, as when checking an already spent input. It is kept in memory
+    // but never written, and an erased record stays erased.
+    bool fAllSpent = true;
+    BOOST_FOREACH(const CDiskTxPos& posSpent, txindex.vSpent)
+    {
+        if (posSpent.IsNull())
+        {
+            fAllSpent = false;
+            break;
+        }
+    }
+    if (!fAllSpent)
+        Store(hash, coins, true);
+    else if (it == mapCoins.end())
+        Store(hash, coins, false);
+    return true;
+}
+
+void CCoinsViewCache::SetCoins(const uint256& hash, const CCoins& coins)
+{
+    LOCK(cs);
+    Store(hash, coins, true);
+}
+
+void CCoinsViewCache::EraseCoins(const uint256& hash)
+{
+    LOCK(cs);
+    CoinsMap::iterator it = mapCoins.find(hash);
+    if (it == mapCoins.end())
+        it = mapCoins.insert(make_pair(hash, CCacheEntry())).first;
+    else
+        nCachedUsage -= EntryUsage(it->second);
+
+    CCacheEntry& entry = it->second;
+    entry.coins.SetNull();
+    entry.fDirty = true;
+    entry.fErased = true;
+    nCachedUsage += EntryUsage(entry);
+}
+
+bool CCoinsViewCache::Flush(CTxDB& txdb, bool fForce)
+{
+    LOCK(cs);
+
+    bool fOverBudget = nCachedUsage > nMaxUsage;
+    if (!fForce && !fOverBudget)
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    unsigned int nWritten = 0;
+    txdb.TxnBegin();
+    for (CoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
+    {
+        CCacheEntry& entry = it->second;
+        if (!entry.fDirty)
+            continue;
+        if (entry.fErased)
+            txdb.EraseCoins(it->first);
+        else
+            txdb.WriteCoins(it->first, entry.coins);
+        nWritten++;
+    }
+    if (!txdb.TxnCommit())
+        return error("CCoinsViewCache::Flush() : TxnCommit failed");
+
+    // The txdb has every change now, so erased records can go and the rest
+    // are clean. Over budget, records that were clean already go first: the
+    // ones just written come from recent blocks and are the likeliest to be
+    // spent next.
+    unsigned int nEvicted = 0;
+    for (CoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); )
+    {
+        CCacheEntry& entry = it->second;
+        if (entry.fErased || (!entry.fDirty && nCachedUsage > nMaxUsage))
+        {
+            if (!entry.fErased)
+                nEvicted++;
+            nCachedUsage -= EntryUsage(entry);
+            it = mapCoins.erase(it);
+            continue;
+        }
+        entry.fDirty = false;
+        ++it;
+    }
+    for (CoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end() && nCachedUsage > nMaxUsage; )
+    {
+        nEvicted++;
+        nCachedUsage -= EntryUsage(it->second);
+        it = mapCoins.erase(it);
+    }
+
+    LogPrint("coindb", "CCoinsViewCache::Flush() : wrote %u records, evicted %u in %dms\n", nWritten, nEvicted, GetTimeMillis() - nStart);
+    return true;
+}
+
+size_t CCoinsViewCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return nCachedUsage;
+}
+
+size_t CCoinsViewCache::GetCacheSize() const
+{
+    LOCK(cs);
+    return mapCoins.size();
+}
+
+void CCoinsViewCache::GetStats(uint64_t& nHitsRet, uint64_t& nDbReadsRet, uint64_t& nRebuildsRet) const
+{
+    LOCK(cs);
+    nHitsRet = nHits;
+    nDbReadsRet = nDbReads;
+    nRebuildsRet = nRebuilds;
+}
+
+bool GetCoins(CTxDB& txdb, const uint256& hash, CCoins& coins, CTxIndex& txindexRet)
+{
+    if (!txdb.ReadTxIndex(hash, txindexRet))
+        return false;
+    return pcoinsTip->GetCoins(txdb, hash, txindexRet, coins);
+}
+
+// Approximate heap footprint of a transaction and its cache entry
+static size_t TransactionUsage(const CTransaction& tx)
+{
+    size_t nUsage = tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
+}
+
+CTransactionCache::CTransactionCache(size_t nMaxUsageIn)
+{
+    nCachedUsage = 0;
+    nMaxUsage = nMaxUsageIn;
+    nHits = 0;
+    nMisses = 0;
+}
+
+void CTransactionCache::EraseEntry(EntryMap::iterator it)
+{
+    nCachedUsage -= it->second->nUsage;
+    listEntries.erase(it->second);
+    mapEntries.erase(it);
+}
+
+bool CTransactionCache::Get(const uint256& hash, const CDiskTxPos& pos, CTransaction& tx)
+{
+    LOCK(cs);
+    EntryMap::iterator it = mapEntries.find(hash);
+    if (it == mapEntries.end() || it->second->pos != pos)
+    {
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    listEntries.splice(listEntries.begin(), listEntries, it->second);
+    tx = it->second->tx;
+    return true;
+}
+
+void CTransactionCache::Add(const uint256& hash, const CDiskTxPos& pos, const CTransaction& tx)
+{
+    // key, list and bucket node pointers, and the transaction itself
+    size_t nUsage = sizeof(uint256) + sizeof(CCacheEntry) + 4 * sizeof(void*) + TransactionUsage(tx);
+    if (nUsage > nMaxUsage)
+        return;
+
+    LOCK(cs);
+    EntryMap::iterator it = mapEntries.find(hash);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+
+    CCacheEntry entry;
+    entry.hash = hash;
+    entry.pos = pos;
+    entry.tx = tx;
+    entry.nUsage = nUsage;
+    listEntries.push_front(entry);
+    mapEntries[hash] = listEntries.begin();
+    nCachedUsage += nUsage;
+
+    while (nCachedUsage > nMaxUsage && !listEntries.empty())
+        EraseEntry(mapEntries.find(listEntries.back().hash));
+}
+
+void CTransactionCache::Erase(const uint256& hash)
+{
+    LOCK(cs);
+    EntryMap::iterator it = mapEntries.find(hash);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+}
+
+size_t CTransactionCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return nCachedUsage;
+}
+
+size_t CTransactionCache::GetCacheSize() const
+{
+    LOCK(cs);
+    return mapEntries.size();
+}
+
+void CTransactionCache::GetStats(uint64_t& nHitsRet, uint64_t& nMissesRet) const
+{
+    LOCK(cs);
+    nHitsRet = nHits;
+    nMissesRet = nMisses;
+}
@@ -0,0 +1,254 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_COINS_H
+#define BITCOIN_COINS_H
+
+#include "main.h"
+#include "sync.h"
+
+#include <list>
+
+#include <boost/unordered_map.hpp>
+
+class CTxDB;
+
+/** Compact record of what validation needs from a transaction in the block
+ *  chain in order to spend its outputs: the outputs themselves, the
+ *  transaction time and kind, and where and when it was confirmed.
+ *
+ *  Records are stored in the txdb under ("coins", hash) and never change once
+ *  written; whether an output is spent is still tracked by CTxIndex::vSpent.
+ *  A record is only valid for the transaction index entry whose position it
+ *  carries, so a record left behind by a block that was later disconnected is
+ *  simply ignored and rebuilt.
+ */
+class CCoins
+{
+public:
+    enum
+    {
+        COINS_COINBASE  = (1 << 0),
+        COINS_COINSTAKE = (1 << 1),
+    };
+
+    int nTxVersion;
+    unsigned char nFlags;
+    unsigned int nTime;
+    unsigned int nBlockTime;
+    int nHeight;
+    CDiskTxPos pos;
+    std::vector<CTxOut> vout;
+
+    CCoins()
+    {
+        SetNull();
+    }
+
+    CCoins(const CTransaction& tx, const CDiskTxPos& posIn, int nHeightIn, unsigned int nBlockTimeIn)
+    {
+        nTxVersion = tx.nVersion;
+        nFlags = 0;
+        if (tx.IsCoinBase())
+            nFlags |= COINS_COINBASE;
+        if (tx.IsCoinStake())
+            nFlags |= COINS_COINSTAKE;
+        nTime = tx.nTime;
+        nBlockTime = nBlockTimeIn;
+        nHeight = nHeightIn;
+        pos = posIn;
+        vout = tx.vout;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nTxVersion);
+        READWRITE(nFlags);
+        READWRITE(nTime);
+        READWRITE(nBlockTime);
+        READWRITE(VARINT(nHeight));
+        READWRITE(pos);
+        unsigned int nOutputs = vout.size();
+        READWRITE(VARINT(nOutputs));
+        if (fRead)
+            const_cast<CCoins*>(this)->vout.resize(nOutputs);
+        for (unsigned int i = 0; i < nOutputs; i++)
+        {
+            CTxOutCompressor txout(REF(vout[i]));
+            READWRITE(txout);
+        }
+    )
+
+    void SetNull()
+    {
+        nTxVersion = 0;
+        nFlags = 0;
+        nTime = 0;
+        nBlockTime = 0;
+        nHeight = -1;
+        pos.SetNull();
+        vout.clear();
+    }
+
+    bool IsNull() const { return pos.IsNull(); }
+    bool IsCoinBase() const { return (nFlags & COINS_COINBASE) != 0; }
+    bool IsCoinStake() const { return (nFlags & COINS_COINSTAKE) != 0; }
+
+    // Approximate heap footprint, used to keep the cache within -dbcache
+    size_t DynamicMemoryUsage() const
+    {
+        size_t nUsage = vout.capacity() * sizeof(CTxOut);
+        BOOST_FOREACH(const CTxOut& txout, vout)
+            nUsage += txout.scriptPubKey.capacity();
+        return nUsage;
+    }
+
+    // Build a stand-in for the original transaction with the same version,
+    // time, outputs and coinbase/coinstake shape, as FetchInputs hands out.
+    // Its inputs are placeholders, so rather than hash to something else it
+    // answers GetHash() with hash, the txid this record was looked up under,
+    // and VerifySignature() can still match it against the spent outpoint.
+    void ToTransaction(const uint256& hash, CTransaction& tx) const;
+};
+
+/** What DisconnectBlock needs to take a block back out of the txdb: the index
+ * entries, as they were before the block, of every earlier transaction it
+ * spends from, the coins records it dropped because it spent their last
+ * output, and the address index entries it added. Written under
+ * ("blockundo", hash) by ConnectBlock, so disconnecting restores these instead
+ * of reading back and patching the index entry of every input, and without
+ * needing block files that -prune may have deleted.
+ */
+class CBlockUndo
+{
+public:
+    // Records written before the version was stored are dropped by
+    // CTxDB::UpgradeBlockUndo, and ReadBlockUndo turns down other versions
+    static const int CURRENT_VERSION = 2;
+    int nVersion;
+    std::vector<std::pair<uint256, CTxIndex> > vPrevTxIndex;
+    std::vector<std::pair<uint256, CCoins> > vPrevCoins;
+    std::vector<std::pair<uint160, uint256> > vAddrIndex;
+
+    CBlockUndo()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(vPrevTxIndex);
+        READWRITE(vPrevCoins);
+        READWRITE(vAddrIndex);
+    )
+
+    void SetNull()
+    {
+        nVersion = CBlockUndo::CURRENT_VERSION;
+        vPrevTxIndex.clear();
+        vPrevCoins.clear();
+        vAddrIndex.clear();
+    }
+};
+
+struct CCoinsKeyHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.Get64(0); }
+};
+
+/** Memory cache of CCoins records in front of the txdb, sized by -dbcache.
+ *  New records are kept dirty in memory and written to the txdb in one batch
+ *  by Flush(). Missing records are read from the txdb, or rebuilt from the
+ *  block files for transactions indexed before the coins records existed.
+ */
+class CCoinsViewCache
+{
+private:
+    struct CCacheEntry
+    {
+        CCoins coins;
+        bool fDirty;
+        bool fErased;
+    };
+    typedef boost::unordered_map<uint256, CCacheEntry, CCoinsKeyHasher> CoinsMap;
+
+    mutable CCriticalSection cs;
+    CoinsMap mapCoins;
+    size_t nCachedUsage;
+    size_t nMaxUsage;
+
+    uint64_t nHits;
+    uint64_t nDbReads;
+    uint64_t nRebuilds;
+
+    static size_t EntryUsage(const CCacheEntry& entry);
+    void Store(const uint256& hash, const CCoins& coins, bool fDirty);
+
+public:
+    CCoinsViewCache(size_t nMaxUsageIn);
+
+    // Look up the record of the transaction indexed by txindex
+    bool GetCoins(CTxDB& txdb, const uint256& hash, const CTxIndex& txindex, CCoins& coins);
+    void SetCoins(const uint256& hash, const CCoins& coins);
+    void EraseCoins(const uint256& hash);
+
+    // Write dirty records to the txdb, and drop clean ones while over budget
+    bool Flush(CTxDB& txdb, bool fForce = false);
+
+    size_t DynamicMemoryUsage() const;
+    size_t GetCacheSize() const;
+    void GetStats(uint64_t& nHitsRet, uint64_t& nDbReadsRet, uint64_t& nRebuildsRet) const;
+};
+
+/** Size-bounded cache of whole transactions read from the block files, keyed
+ *  by txid and evicting the least recently used. Like a CCoins record, an
+ *  entry only answers for the index entry whose position it was read from.
+ *  Connected blocks add their transactions and disconnected ones remove them.
+ */
+class CTransactionCache
+{
+private:
+    struct CCacheEntry
+    {
+        uint256 hash;
+        CDiskTxPos pos;
+        CTransaction tx;
+        size_t nUsage;
+    };
+    typedef std::list<CCacheEntry> EntryList;
+    typedef boost::unordered_map<uint256, EntryList::iterator, CCoinsKeyHasher> EntryMap;
+
+    mutable CCriticalSection cs;
+    EntryList listEntries; // most recently used first
+    EntryMap mapEntries;
+    size_t nCachedUsage;
+    size_t nMaxUsage;
+
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    void EraseEntry(EntryMap::iterator it);
+
+public:
+    CTransactionCache(size_t nMaxUsageIn);
+
+    bool Get(const uint256& hash, const CDiskTxPos& pos, CTransaction& tx);
+    void Add(const uint256& hash, const CDiskTxPos& pos, const CTransaction& tx);
+    void Erase(const uint256& hash);
+
+    size_t DynamicMemoryUsage() const;
+    size_t GetCacheSize() const;
+    void GetStats(uint64_t& nHitsRet, uint64_t& nMissesRet) const;
+};
+
+extern CCoinsViewCache *pcoinsTip;
+extern CTransactionCache *ptxCache;
+
+/** Resolve the outputs of a transaction in the main chain without reading the
+    block files, returning its index entry as well */
+bool GetCoins(CTxDB& txdb, const uint256& hash, CCoins& coins, CTxIndex& txindexRet);
+
+#endif // BITCOIN_COINS_H
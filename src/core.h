@@ -11,9 +11,15 @@
 
 #include <stdio.h>
 
+#include <boost/shared_ptr.hpp>
+
 class CScript;
 class CTransaction;
 
+/** Shared reference to a transaction that nobody modifies any more. The memory
+ *  pool, FetchInputs and relay pass these around instead of copying it. */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
 class COutPoint
 {
@@ -51,11 +57,11 @@ public:
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
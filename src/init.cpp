@@ -166,11 +166,20 @@ void Shutdown()
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
+        if (pcoinsTip)
+        {
+            CTxDB txdb("r+");
+            pcoinsTip->Flush(txdb, true);
+            txdb.Commit(true);
+            txdb.WriteBlockIndexSnapshot();
+        }
+        CloseBlockFileWriter();
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         bitdb.Flush(true);
 #endif
+    CloseBlockFileHandles();
     boost::filesystem::remove(GetPidFile());
     UnregisterAllWallets();
 #ifdef ENABLE_WALLET
@@ -229,7 +238,10 @@ std::string HelpMessage()
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: societyGd.pid)") + "\n";
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
-    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 10)") + "\n";
+    strUsage += "  -dbcache=<n>           " + _("Set database and coins cache size in megabytes (default: 10)") + "\n";
+    strUsage += "  -txcache=<n>           " + _("Set the size of the cache of transactions read from the block files in megabytes (default: 8)") + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Limit the size of the signature cache to <n> megabytes (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -dbwalletcache=<n>     " + _("Set wallet database cache size in megabytes (default: 1)") + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
@@ -305,6 +317,16 @@ std::string HelpMessage()
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
+    strUsage += "  -loadsnapshot=<file>   " + _("Start an empty node from a UTXO snapshot written by dumpsnapshot and sync on from there") + "\n";
+    strUsage += "  -snapshothash=<hash>   " + _("Only accept a UTXO snapshot with this checksum (required by -loadsnapshot)") + "\n";
+    strUsage += "  -allowunverifiedsnapshot " + _("Load a UTXO snapshot without -snapshothash (unsafe, the snapshot is trusted blindly)") + "\n";
+    strUsage += "  -prune=<n>             " + strprintf(_("Delete the oldest block files while they take more than <n> MiB, always keeping the last %d blocks (default: 0 = disabled, minimum: %u)"), MIN_BLOCKS_TO_KEEP, MIN_PRUNE_TARGET_MB) + "\n";
+    strUsage += "  -compressblocks        " + _("Store new blocks LZ4 compressed, blocks already on disk are read either way (default: 0)") + "\n";
+    strUsage += "  -addressindex          " + _("Maintain the unspent outputs and balance changes of every address, for getaddressbalance and getaddressutxos (default: 0)") + "\n";
+    strUsage += "  -spentindex            " + _("Maintain where every output was spent, for getspentinfo (default: 0)") + "\n";
+    strUsage += "  -commitblocks=<n>      " + strprintf(_("While catching up, sync block data and the transaction index to disk at most every <n> blocks (default: %u)"), DEFAULT_COMMIT_BLOCKS) + "\n";
+    strUsage += "  -commitsize=<n>        " + strprintf(_("While catching up, sync once <n> megabytes have been written (default: %u)"), DEFAULT_COMMIT_SIZE) + "\n";
+    strUsage += "  -commitinterval=<n>    " + strprintf(_("While catching up, sync at least every <n> seconds (default: %d)"), DEFAULT_COMMIT_INTERVAL) + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
@@ -415,6 +437,10 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fAddrIndex = GetBoolArg("-addrindex", false);
+    fAddressIndex = GetBoolArg("-addressindex", false);
+    fSpentIndex = GetBoolArg("-spentindex", false);
+    fCompressBlocks = GetBoolArg("-compressblocks", false);
     nMinerSleep = GetArg("-minersleep", 500);
 
     nDerivationMethodIndex = 0;
@@ -423,6 +449,29 @@ bool AppInit2(boost::thread_group& threadGroup)
         return InitError("Invalid combination of -testnet and -regtest.");
     }
 
+    // A pruned node does not keep the history needed to serve old blocks or to build the address index
+    int64_t nPruneArg = GetArg("-prune", 0);
+    if (nPruneArg < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    if (nPruneArg > 0)
+    {
+        if ((uint64_t)nPruneArg < MIN_PRUNE_TARGET_MB)
+            return InitError(strprintf(_("Prune configured below the minimum of %u MiB. Please use a higher number."), MIN_PRUNE_TARGET_MB));
+        if (fAddrIndex)
+            return InitError(_("Prune mode is incompatible with -addrindex."));
+        if (fAddressIndex || fSpentIndex)
+            return InitError(_("Prune mode is incompatible with -addressindex and -spentindex."));
+        fPruneMode = true;
+        nPruneTarget = (uint64_t)nPruneArg << 20;
+        nLocalServices &= ~NODE_NETWORK;
+        LogPrintf("Prune mode: keeping block files under %d MiB\n", nPruneArg);
+    }
+
+    // spacing of commit points while catching up, read once as every txdb commit consults it
+    nCommitBlocks = std::max((int64_t)1, GetArg("-commitblocks", DEFAULT_COMMIT_BLOCKS));
+    nCommitBytes = (uint64_t)std::max((int64_t)1, GetArg("-commitsize", DEFAULT_COMMIT_SIZE)) << 20;
+    nCommitInterval = std::max((int64_t)1, GetArg("-commitinterval", DEFAULT_COMMIT_INTERVAL));
+
     if (mapArgs.count("-bind")) {
         // when specifying an explicit binding address, you want to listen on it
         // even when -connect or -proxy is specified
@@ -498,6 +547,15 @@ bool AppInit2(boost::thread_group& threadGroup)
         fNoSmsg = GetBoolArg("-nosmsg", false);
 
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
     // Check for -debugnet (deprecated)
     if (GetBoolArg("-debugnet", false))
         InitWarning(_("Warning: Deprecated argument -debugnet ignored, use -debug=net"));
@@ -602,6 +660,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fDaemon)
         fprintf(stdout, "SocietyG server starting\n"); 
 
+    if (nScriptCheckThreads)
+    {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: Backup wallet and verify wallet database integrity
@@ -850,6 +915,37 @@ LogPrintf("RGP Debug 002 \n");
 
     uiInterface.InitMessage(_("Loading block index..."));
 
+    // cache of unspent output records, sized like the LevelDB cache
+    pcoinsTip = new CCoinsViewCache(GetArg("-dbcache", 10) << 20);
+    // recently used whole transactions, for prevout and getrawtransaction lookups
+    ptxCache = new CTransactionCache(std::max((int64_t)0, GetArg("-txcache", 8)) << 20);
+
+    // a UTXO snapshot can only seed an empty block database
+    if (mapArgs.count("-loadsnapshot"))
+    {
+        CTxDB txdbSnapshot("cr+");
+        uint256 hashBest;
+        if (txdbSnapshot.ReadHashBestChain(hashBest))
+            LogPrintf("Block database is not empty, ignoring -loadsnapshot\n");
+        else
+        {
+            uiInterface.InitMessage(_("Loading UTXO snapshot..."));
+            nStart = GetTimeMillis();
+            string strError;
+            if (!txdbSnapshot.LoadSnapshot(GetArg("-loadsnapshot", ""), strError))
+                return InitError(strprintf(_("Error loading UTXO snapshot: %s"), strError));
+            LogPrintf(" UTXO snapshot %15dms\n", GetTimeMillis() - nStart);
+        }
+    }
+
+    // drop undo records written by an older version before LoadBlockIndex
+    // gets a chance to disconnect blocks with them
+    {
+        CTxDB txdbUndo("r+");
+        if (!txdbUndo.UpgradeBlockUndo())
+            return InitError(_("Error upgrading block undo data"));
+    }
+
     nStart = GetTimeMillis();
     if (!LoadBlockIndex())
         return InitError(_("Error loading block database"));
@@ -865,6 +961,36 @@ LogPrintf("RGP Debug 002 \n");
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    // convert an address index written by an older version to the height
+    // ordered format
+    {
+        CTxDB txdbAddr("r+");
+        if (!txdbAddr.UpgradeAddrIndex())
+            return InitError(_("Error upgrading address index"));
+    }
+
+    // build the address and spent indexes when they are turned on; one that is
+    // turned off goes stale and is rebuilt when it is turned on again
+    {
+        CTxDB txdbAddr("r+");
+        bool fHaveAddressIndex = false, fHaveSpentIndex = false;
+        txdbAddr.ReadFlag("addressindex", fHaveAddressIndex);
+        txdbAddr.ReadFlag("spentindex", fHaveSpentIndex);
+        if ((fAddressIndex && !fHaveAddressIndex) || (fSpentIndex && !fHaveSpentIndex))
+        {
+            uiInterface.InitMessage(_("Rebuilding address indexes..."));
+            nStart = GetTimeMillis();
+            if (!RebuildAddressIndexes())
+                return InitError(_("Error building address indexes"));
+            LogPrintf(" address indexes %15dms\n", GetTimeMillis() - nStart);
+        }
+        else if (fHaveAddressIndex != fAddressIndex || fHaveSpentIndex != fSpentIndex)
+        {
+            txdbAddr.WriteFlag("addressindex", fAddressIndex);
+            txdbAddr.WriteFlag("spentindex", fSpentIndex);
+        }
+    }
+
     if (GetBoolArg("-printblockindex", false) || GetBoolArg("-printblocktree", false))
     {
         PrintBlockTree();
@@ -875,7 +1001,7 @@ LogPrintf("RGP Debug 002 \n");
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -979,6 +1105,8 @@ LogPrintf("RGP Debug 002 \n");
         }
         if (pindexBest != pindexRescan && pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
         {
+            if (fPruneMode && !HaveBlockData(pindexRescan))
+                return InitError(_("Rescans are not possible in pruned mode: the blocks since the wallet was last used have been deleted."));
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
@@ -1156,7 +1284,7 @@ LogPrintf("RGP Debug 002 \n");
 	    bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
 	    CBlock pblockAddr;
 	    if(pblockAddr.ReadFromDisk(pblockAddrIndex, true))
-	        pblockAddr.RebuildAddressIndex(txdbAddr);
+	        pblockAddr.RebuildAddressIndex(txdbAddr, pblockAddrIndex->nHeight);
 	    pblockAddrIndex = pblockAddrIndex->pprev;
 	}
     }
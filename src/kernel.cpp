@@ -27,6 +27,9 @@ static bool GetLastStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModi
 {
     if (!pindex)
         return error("GetLastStakeModifier: null pindex");
+    // Which block generated the modifier is only known from the block itself,
+    // so there is no height for GetAncestor() to jump to. It is rarely more
+    // than a few blocks back, as a modifier is generated every nModifierInterval.
     while (pindex && pindex->pprev && !pindex->GeneratedStakeModifier())
         pindex = pindex->pprev;
     if (!pindex->GeneratedStakeModifier())
@@ -52,20 +55,22 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+// Candidate block for the stake modifier: ordered by timestamp, then by hash,
+// and carrying its index entry so that selection needs no lookups
+typedef pair<pair<int64_t, uint256>, const CBlockIndex*> ModifierCandidate;
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
 // already selected blocks in vSelectedBlocks, and with timestamp up to
 // nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
+static bool SelectBlockFromCandidates(vector<ModifierCandidate>& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
     int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, const CBlockIndex** pindexSelected)
 {
     bool fSelected = false;
     uint256 hashBest = 0;
     *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+    BOOST_FOREACH(const ModifierCandidate& item, vSortedByTimestamp)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
+        const CBlockIndex* pindex = item.second;
         if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
             break;
         if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
@@ -128,15 +133,17 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
         return true;
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
+    vector<ModifierCandidate> vSortedByTimestamp;
     vSortedByTimestamp.reserve(64 * nModifierInterval / TARGET_SPACING);
 
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
+    // Every block of the interval is a candidate, and timestamps are not
+    // monotonic in height, so this walk cannot skip ahead with GetAncestor()
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        vSortedByTimestamp.push_back(make_pair(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()), pindex));
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
@@ -167,13 +174,12 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
         string strSelectionMap = "";
         // '-' indicates proof-of-work blocks not selected
         strSelectionMap.insert(0, pindexPrev->nHeight - nHeightFirstCandidate + 1, '-');
-        pindex = pindexPrev;
-        while (pindex && pindex->nHeight >= nHeightFirstCandidate)
+        // The candidates are the blocks of the interval, no need to walk it again
+        BOOST_FOREACH(const ModifierCandidate& item, vSortedByTimestamp)
         {
             // '=' indicates proof-of-stake blocks not selected
-            if (pindex->IsProofOfStake())
-                strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
-            pindex = pindex->pprev;
+            if (item.second->IsProofOfStake())
+                strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, "=");
         }
         BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
         {
@@ -289,21 +295,18 @@ int64_t Time_to_Last_block;
 
     // First try finding the previous transaction in database
     CTxDB txdb("r");
-    CTransaction txPrev;
+    CCoins coins;
     CTxIndex txindex;
-    if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+    if (!GetCoins(txdb, txin.prevout.hash, coins, txindex) || txin.prevout.n >= coins.vout.size())
         return tx.DoS(1, error("CheckProofOfStake() : INFO: read txPrev failed"));  // previous transaction not in main chain, may occur during initial download
 
+    CTransaction txPrev;
+    coins.ToTransaction(txin.prevout.hash, txPrev);
+
     // Verify signature
     if (!VerifySignature(txPrev, tx, 0, SCRIPT_VERIFY_NONE, 0))
         return tx.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString()));
-
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-        return fDebug? error("CheckProofOfStake() : read block failed") : false; // unable to read block of previous transaction
-
-    if (!CheckStakeKernelHash(pindexPrev, nBits, block.GetBlockTime(), txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
+    if (!CheckStakeKernelHash(pindexPrev, nBits, coins.nBlockTime, txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
     {
         /* RGP, found this on machines with disks that may be close to the end, data corruption
                 in this case, if we are out of synch by more than 30 minutes, allow through     */
@@ -334,21 +337,18 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
     uint256 hashProofOfStake, targetProofOfStake;
 
     CTxDB txdb("r");
-    CTransaction txPrev;
+    CCoins coins;
     CTxIndex txindex;
-    if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
+    if (!GetCoins(txdb, prevout.hash, coins, txindex) || prevout.n >= coins.vout.size())
         return false;
 
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-        return false;
-
-    if (block.GetBlockTime() + nStakeMinAge > nTime)
+    if ((int64_t)coins.nBlockTime + nStakeMinAge > nTime)
         return false; // only count coins meeting min age requirement
 
     if (pBlockTime)
-        *pBlockTime = block.GetBlockTime();
+        *pBlockTime = coins.nBlockTime;
 
-    return CheckStakeKernelHash(pindexPrev, nBits, block.GetBlockTime(), txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
+    CTransaction txPrev;
+    coins.ToTransaction(prevout.hash, txPrev);
+    return CheckStakeKernelHash(pindexPrev, nBits, coins.nBlockTime, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
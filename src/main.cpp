@@ -20,12 +20,16 @@
 
 #include "main.h"
 
+#include <deque>
 #include <limits>
+#include <list>
 
 #include "addrman.h"
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
+#include "coins.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -41,6 +45,7 @@
 #include "smessage.h"
 #include "util.h"
 #include "rpcserver.h"
+#include "lz4/lz4.h"
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -60,7 +65,7 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
@@ -99,7 +104,16 @@ int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fAddrIndex = false;
+bool fAddressIndex = false;
+bool fSpentIndex = false;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
+unsigned int nCommitBlocks = DEFAULT_COMMIT_BLOCKS;
+uint64_t nCommitBytes = DEFAULT_COMMIT_SIZE << 20;
+int64_t nCommitInterval = DEFAULT_COMMIT_INTERVAL;
+bool fCompressBlocks = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
 
 /* RGP, static Inventory structure using with AskFor()
    to request investory data                           */
@@ -131,6 +145,8 @@ std::set<uint256> setValidatedTx;
 
 extern Semaphore thread_semaphore;
 
+static void NoteBlockFileHeight(unsigned int nFile, int nHeight);
+
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -383,8 +399,12 @@ bool CTransaction::ReadFromDisk(CTxDB& txdb, const uint256& hash, CTxIndex& txin
     SetNull();
     if (!txdb.ReadTxIndex(hash, txindexRet))
         return false;
+    if (ptxCache && ptxCache->Get(hash, txindexRet.pos, *this))
+        return true;
     if (!ReadFromDisk(txindexRet.pos))
         return false;
+    if (ptxCache)
+        ptxCache->Add(hash, txindexRet.pos, *this);
     return true;
 }
 
@@ -668,7 +688,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1153,7 +1173,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1266,7 +1286,7 @@ int GetInputAge(CTxIn& vin)
 
     //LogPrintf("*** RGP GetInputAge Start \n ");
 
-    bool fFound = GetTransaction(prevHash, tx, hashBlock);
+    bool fFound = GetTransaction(prevHash, tx, hashBlock, true);
     if ( fFound )
     {
         //LogPrintf("*** RGP GetInputAge Found \n ");
@@ -1333,7 +1353,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1343,7 +1363,7 @@ int CTxIndex::GetDepthInMainChain() const
 }
 
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
-bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
+bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowPruned)
 {
     {
         LOCK(cs_main);
@@ -1362,6 +1382,16 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
                 hashBlock = block.GetHash();
             return true;
         }
+        // Without the block data the coins record still has the outputs and height
+        CCoins coins;
+        if (fAllowPruned && !txindex.pos.IsNull() && pcoinsTip->GetCoins(txdb, hash, txindex, coins))
+        {
+            coins.ToTransaction(hash, tx);
+            CBlockIndex* pindex = FindBlockByHeight(coins.nHeight);
+            if (pindex)
+                hashBlock = pindex->GetBlockHash();
+            return true;
+        }
         // look for transaction in disconnected blocks to find orphaned CoinBase and CoinStake transactions
         BOOST_FOREACH(PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
         {
@@ -1389,39 +1419,112 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+// Main chain blocks indexed by height. Only the entries that differ from the
+// new chain are rewritten when the best block changes. vActiveChainMaxTime
+// holds the highest timestamp up to each height, which never decreases and
+// so can be binary searched even though block times are not ordered.
+static CCriticalSection cs_vActiveChain;
+static vector<CBlockIndex*> vActiveChain;
+static vector<unsigned int> vActiveChainMaxTime;
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-CBlockIndex *pblockindex;
+    LOCK(cs_vActiveChain);
+    if (nHeight < 0 || nHeight >= (int)vActiveChain.size())
+        return NULL;
+    return vActiveChain[nHeight];
+}
 
-    if (nHeight < nBestHeight / 2)
-    {
-        pblockindex = pindexGenesisBlock;
-    }
-    else
+void SetActiveChain(CBlockIndex* pindexNew)
+{
+    LOCK(cs_vActiveChain);
+    if (pindexNew == NULL)
     {
-        pblockindex = pindexBest;
+        vActiveChain.clear();
+        vActiveChainMaxTime.clear();
+        return;
     }
-
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
+    vActiveChain.resize(pindexNew->nHeight + 1);
+    vActiveChainMaxTime.resize(pindexNew->nHeight + 1);
+    int nHeightChanged = pindexNew->nHeight + 1;
+    for (CBlockIndex* pindex = pindexNew; pindex && vActiveChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
     {
-        pblockindex = pblockindexFBBHLast;
+        vActiveChain[pindex->nHeight] = pindex;
+        nHeightChanged = pindex->nHeight;
     }
-    while (pblockindex->nHeight > nHeight)
+    for (int nHeight = nHeightChanged; nHeight <= pindexNew->nHeight; nHeight++)
     {
-        pblockindex = pblockindex->pprev;
-        //MilliSleep(1); /* RGP Optimize */
+        unsigned int nTimePrev = nHeight > 0 ? vActiveChainMaxTime[nHeight - 1] : 0;
+        vActiveChainMaxTime[nHeight] = std::max(nTimePrev, vActiveChain[nHeight]->nTime);
     }
+}
 
-    while (pblockindex->nHeight < nHeight)
+CBlockIndex* FindBlockByTime(int64_t nTime)
+{
+    LOCK(cs_vActiveChain);
+    if (nTime <= 0)
+        return vActiveChain.empty() ? NULL : vActiveChain[0];
+    if (nTime > std::numeric_limits<unsigned int>::max())
+        return NULL;
+    vector<unsigned int>::const_iterator it = std::lower_bound(vActiveChainMaxTime.begin(), vActiveChainMaxTime.end(), (unsigned int)nTime);
+    if (it == vActiveChainMaxTime.end())
+        return NULL;
+    return vActiveChain[it - vActiveChainMaxTime.begin()];
+}
+
+// Block index entries live until shutdown, so they are carved out of large
+// slabs instead of being allocated one by one. Callers hold cs_main or run
+// before the node has started.
+static const unsigned int BLOCKINDEX_SLAB_ENTRIES = 4096;
+static vector<CBlockIndex*> vBlockIndexSlabs;
+static unsigned int nBlockIndexSlabUsed = BLOCKINDEX_SLAB_ENTRIES;
+
+void* AllocBlockIndex()
+{
+    if (nBlockIndexSlabUsed == BLOCKINDEX_SLAB_ENTRIES)
     {
-        pblockindex = pblockindex->pnext;
-        //MilliSleep(1); /* RGP Optimize */
+        vBlockIndexSlabs.push_back(static_cast<CBlockIndex*>(::operator new(BLOCKINDEX_SLAB_ENTRIES * sizeof(CBlockIndex))));
+        nBlockIndexSlabUsed = 0;
     }
+    return vBlockIndexSlabs.back() + nBlockIndexSlabUsed++;
+}
 
-    pblockindexFBBHLast = pblockindex;
+void InitBlockIndexMap()
+{
+    assert(mapBlockIndex.empty());
+    BlockMap mapSalted(0, BlockHasher(GetRand(std::numeric_limits<uint64_t>::max()),
+                                      GetRand(std::numeric_limits<uint64_t>::max())));
+    mapBlockIndex.swap(mapSalted);
+}
+
+// Log what the loaded block index costs in memory and per lookup
+static void LogBlockIndexStats()
+{
+    if (mapBlockIndex.empty())
+        return;
 
-    return pblockindex;
+    // Entries in the slabs, then the table nodes and the bucket array
+    size_t nSlabBytes = vBlockIndexSlabs.size() * BLOCKINDEX_SLAB_ENTRIES * sizeof(CBlockIndex);
+    size_t nTableBytes = mapBlockIndex.size() * (sizeof(BlockMap::value_type) + sizeof(void*)) +
+                         mapBlockIndex.bucket_count() * sizeof(void*);
+
+    // Time lookups of up to 100000 known hashes spread over the index
+    vector<uint256> vProbe;
+    size_t nStride = mapBlockIndex.size() / 100000 + 1, n = 0;
+    vProbe.reserve(mapBlockIndex.size() / nStride + 1);
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi, ++n)
+        if (n % nStride == 0)
+            vProbe.push_back(mi->first);
+
+    int64_t nStart = GetTimeMicros();
+    size_t nFound = 0;
+    BOOST_FOREACH(const uint256& hash, vProbe)
+        nFound += mapBlockIndex.count(hash);
+    int64_t nElapsed = GetTimeMicros() - nStart;
+
+    LogPrintf("Block index: %u entries, %uKiB in %u slabs, %uKiB table (load factor %.2f), %.3fus per lookup (%u probes)\n",
+        mapBlockIndex.size(), nSlabBytes / 1024, vBlockIndexSlabs.size(), nTableBytes / 1024,
+        mapBlockIndex.load_factor(), (double)nElapsed / vProbe.size(), nFound);
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -2006,7 +2109,7 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 
 
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const
 {
     // FetchInputs can return false either because we just haven't seen some inputs
     // (in which case the transaction should be stored as an orphan)
@@ -2040,20 +2143,25 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             return fMiner ? false : error("FetchInputs() : %s prev tx %s index entry not found", GetHash().ToString(),  prevout.hash.ToString());
 
         // Read txPrev
-        CTransaction& txPrev = inputsRet[prevout.hash].second;
+        CTransactionRef& txPrev = inputsRet[prevout.hash].second;
         if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
         {
-            // Get prev tx from single transactions in memory
-            if (!mempool.lookup(prevout.hash, txPrev))
+            // Share prev tx with the memory pool
+            txPrev = mempool.get(prevout.hash);
+            if (!txPrev)
                 return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString(),  prevout.hash.ToString());
             if (!fFound)
-                txindex.vSpent.resize(txPrev.vout.size());
+                txindex.vSpent.resize(txPrev->vout.size());
         }
         else
         {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
-                return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString(),  prevout.hash.ToString());
+            // Get prev tx outputs through the coins cache rather than the block files
+            CCoins coins;
+            if (!pcoinsTip->GetCoins(txdb, prevout.hash, txindex, coins))
+                return error("FetchInputs() : %s GetCoins prev tx %s failed", GetHash().ToString(),  prevout.hash.ToString());
+            boost::shared_ptr<CTransaction> ptxPrev(new CTransaction());
+            coins.ToTransaction(prevout.hash, *ptxPrev);
+            txPrev = ptxPrev;
         }
     }
 
@@ -2063,7 +2171,7 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         const COutPoint prevout = vin[i].prevout;
         assert(inputsRet.count(prevout.hash) != 0);
         const CTxIndex& txindex = inputsRet[prevout.hash].first;
-        const CTransaction& txPrev = inputsRet[prevout.hash].second;
+        const CTransaction& txPrev = *inputsRet[prevout.hash].second;
         if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
         {
             // Revisit this if/when transaction replacement is implemented and allows
@@ -2082,7 +2190,7 @@ const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& in
     if (mi == inputs.end())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.hash not found");
 
-    const CTransaction& txPrev = (mi->second).second;
+    const CTransaction& txPrev = *(mi->second).second;
     if (input.prevout.n >= txPrev.vout.size())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.n out of range");
 
@@ -2103,8 +2211,25 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
+bool CScriptCheck::operator()() const
+{
+    const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed on input %u", ptxTo->GetHash().ToString(), nIn);
+    return true;
+}
+
+// Script checks queued by ConnectBlock, run by the -par worker threads
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck()
+{
+    RenameThread("SocietyG-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig, std::vector<CScriptCheck>* pvChecks) const
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -2119,7 +2244,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
             CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            const CTransaction& txPrev = *inputs[prevout.hash].second;
 
             if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
                 return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), txPrev.ToString()));
@@ -2150,7 +2275,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
             CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            const CTransaction& txPrev = *inputs[prevout.hash].second;
 
             // Check for conflicts (double-spend)
             // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
@@ -2174,8 +2299,16 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                 // still computed and checked, and any change will be caught at the next checkpoint.
                 if (!(fBlock && !IsInitialBlockDownload()))
                 {
-                    // Verify signature
-                    if (!VerifySignature(txPrev, *this, i, flags, 0))
+                    // Verify signature. A queued check only carries the
+                    // script, so the outpoint is matched against txPrev here
+                    // as VerifySignature does.
+                    if (pvChecks)
+                    {
+                        if (prevout.hash != txPrev.GetHash())
+                            return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString()));
+                        pvChecks->push_back(CScriptCheck(txPrev.vout[prevout.n].scriptPubKey, *this, i, flags, 0));
+                    }
+                    else if (!VerifySignature(txPrev, *this, i, flags, 0))
                     {
                         if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
                             // Check whether the failure was caused by a
@@ -2228,12 +2361,76 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
     return true;
 }
 
+static bool GetTxAddrIds(CTxDB& txdb, const CTransaction& tx, std::vector<uint160>& addrIds);
+static bool GetPrevOutputs(CTxDB& txdb, const CTransaction& tx, std::vector<std::pair<CTxOut, int> >& vPrevOut);
+static bool UpdateAddressIndexes(CTxDB& txdb, const CTransaction& tx, const std::vector<std::pair<CTxOut, int> >& vPrevOut, int nHeight, bool fConnect);
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
-    // Disconnect in reverse order
-    for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
-            return false;
+    uint256 hashBlock = pindex->GetBlockHash();
+
+    // Take the block out of the address indexes first, while the transactions
+    // it spends from, including its own, can still be looked up
+    if (fAddressIndex || fSpentIndex)
+    {
+        for (int i = vtx.size()-1; i >= 0; i--)
+        {
+            std::vector<std::pair<CTxOut, int> > vPrevOut;
+            if (!GetPrevOutputs(txdb, vtx[i], vPrevOut) || !UpdateAddressIndexes(txdb, vtx[i], vPrevOut, pindex->nHeight, false))
+                return error("DisconnectBlock() : address index update failed");
+        }
+    }
+
+    CBlockUndo undo;
+    if (txdb.ReadBlockUndo(hashBlock, undo))
+    {
+        BOOST_FOREACH(const PAIRTYPE(uint160, uint256)& item, undo.vAddrIndex)
+            txdb.EraseAddrIndex(item.first, pindex->nHeight, item.second);
+
+        // Put back the index entries of the transactions this block spent
+        // from, then forget the transactions it added
+        BOOST_FOREACH(const PAIRTYPE(uint256, CTxIndex)& item, undo.vPrevTxIndex)
+            if (!txdb.UpdateTxIndex(item.first, item.second))
+                return error("DisconnectBlock() : UpdateTxIndex failed");
+        BOOST_FOREACH(const PAIRTYPE(uint256, CCoins)& item, undo.vPrevCoins)
+            pcoinsTip->SetCoins(item.first, item.second);
+        for (int i = vtx.size()-1; i >= 0; i--)
+            txdb.EraseTxIndex(vtx[i]);
+
+        txdb.EraseBlockUndo(hashBlock);
+    }
+    else
+    {
+        // Connected before undo records were kept, or deeper than they are kept
+
+        // Drop the address index entries of this block while the transactions
+        // it spends from are still readable
+        if (fAddrIndex)
+        {
+            BOOST_FOREACH(CTransaction& tx, vtx)
+            {
+                uint256 hashTx = GetTxHash(&tx - &vtx[0]);
+                std::vector<uint160> addrIds;
+                if (!GetTxAddrIds(txdb, tx, addrIds))
+                    continue;
+                BOOST_FOREACH(const uint160& addrId, addrIds)
+                    txdb.EraseAddrIndex(addrId, pindex->nHeight, hashTx);
+            }
+        }
+
+        // Disconnect in reverse order
+        for (int i = vtx.size()-1; i >= 0; i--)
+            if (!vtx[i].DisconnectInputs(txdb))
+                return false;
+    }
+
+    // Outputs created by this block no longer exist
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        pcoinsTip->EraseCoins(GetTxHash(i));
+        if (ptxCache)
+            ptxCache->Erase(GetTxHash(i));
+    }
 
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
@@ -2252,6 +2449,52 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+void BenchmarkDisconnectReads(int nBlocks, int& nBlocksRet, int& nUndoRet, unsigned int& nInputsRet, int64_t& nUndoTimeRet, int64_t& nReadTimeRet)
+{
+    nBlocksRet = 0;
+    nUndoRet = 0;
+    nInputsRet = 0;
+    nUndoTimeRet = 0;
+    nReadTimeRet = 0;
+
+    CTxDB txdb("r");
+    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev && nBlocksRet < nBlocks; pindex = pindex->pprev)
+    {
+        CBlock block;
+        if (!HaveBlockData(pindex) || !block.ReadFromDisk(pindex))
+            break;
+        nBlocksRet++;
+
+        int64_t nStart = GetTimeMicros();
+        CBlockUndo undo;
+        if (txdb.ReadBlockUndo(pindex->GetBlockHash(), undo))
+            nUndoRet++;
+        nUndoTimeRet += GetTimeMicros() - nStart;
+
+        // Without the undo record, DisconnectInputs reads back the index entry
+        // of every transaction spent from, and the address index the
+        // transactions themselves
+        nStart = GetTimeMicros();
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            if (fAddrIndex)
+            {
+                std::vector<uint160> addrIds;
+                GetTxAddrIds(txdb, tx, addrIds);
+            }
+            if (tx.IsCoinBase())
+                continue;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                CTxIndex txindex;
+                txdb.ReadTxIndex(txin.prevout.hash, txindex);
+                nInputsRet++;
+            }
+        }
+        nReadTimeRet += GetTimeMicros() - nStart;
+    }
+}
+
 bool static BuildAddrIndex(const CScript &script, std::vector<uint160>& addrIds)
 {
 CScript::const_iterator pc = script.begin();
@@ -2294,7 +2537,7 @@ uint160 addrid = 0;
     }
 }
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash) {
+bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash, int nSkip, int nCount) {
     uint160 addrid = 0;
     const CKeyID *pkeyid = boost::get<CKeyID>(&dest);
     if (pkeyid)
@@ -2312,7 +2555,10 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
 
     LOCK(cs_main);
     CTxDB txdb("r");
-    if(!txdb.ReadAddrIndex(addrid, vtxhash))
+    // A negative skip counts back from the most recent transaction
+    unsigned int nMax = nCount < 0 ? std::numeric_limits<unsigned int>::max() : (unsigned int)nCount;
+    bool fRead = nSkip < 0 ? txdb.ReadAddrIndexLast(addrid, vtxhash, -(int64_t)nSkip, nMax) : txdb.ReadAddrIndex(addrid, vtxhash, nSkip, nMax);
+    if(!fRead)
     {
         LogPrintf("FindTransactionsByDestination(): txdb.ReadAddrIndex failed\n");
         return false;
@@ -2320,54 +2566,192 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
     return true;
 }
 
-void CBlock::RebuildAddressIndex(CTxDB& txdb)
+// Collect the address ids a transaction is indexed under: the destinations of
+// its own outputs and those of the transactions it spends from.
+static bool GetTxAddrIds(CTxDB& txdb, const CTransaction& tx, std::vector<uint160>& addrIds)
 {
-    BOOST_FOREACH(CTransaction& tx, vtx)
+    // inputs
+    if(!tx.IsCoinBase())
     {
-        uint256 hashTx = tx.GetHash();
-        // inputs
-        if(!tx.IsCoinBase())
+        MapPrevTx mapInputs;
+        map<uint256, CTxIndex> mapQueuedChangesT;
+        bool fInvalid;
+        if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
+            return false;
+
+        for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
         {
-            MapPrevTx mapInputs;
-            map<uint256, CTxIndex> mapQueuedChangesT;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-                return;
+            BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second->vout)
+                BuildAddrIndex(atxout.scriptPubKey, addrIds);
+        }
+    }
+    // outputs
+    BOOST_FOREACH(const CTxOut &atxout, tx.vout)
+        BuildAddrIndex(atxout.scriptPubKey, addrIds);
 
-            MapPrevTx::const_iterator mi;
-            for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-            {
-                BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-                {
-                    std::vector<uint160> addrIds;
-                    if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                    {
-                        BOOST_FOREACH(uint160 addrId, addrIds)
-                        {
-                            if(!txdb.WriteAddrIndex(addrId, hashTx))
-                                LogPrintf("RebuildAddressIndex(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                        }
-                    }
-                }
-            }
+    sort(addrIds.begin(), addrIds.end());
+    addrIds.erase(unique(addrIds.begin(), addrIds.end()), addrIds.end());
+    return true;
+}
+
+static bool WriteTxAddrIndex(CTxDB& txdb, const CTransaction& tx, int nHeight, std::vector<std::pair<uint160, uint256> >* pvUndo = NULL)
+{
+    uint256 hashTx = tx.GetHash();
+    std::vector<uint160> addrIds;
+    if (!GetTxAddrIds(txdb, tx, addrIds))
+        return false;
+    BOOST_FOREACH(const uint160& addrId, addrIds)
+    {
+        if(!txdb.WriteAddrIndex(addrId, nHeight, hashTx))
+            LogPrintf("WriteTxAddrIndex(): WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
+        if (pvUndo)
+            pvUndo->push_back(make_pair(addrId, hashTx));
+    }
+    return true;
+}
+
+bool GetAddressIndexKey(const CTxDestination& dest, unsigned char& addressType, uint160& addressHash)
+{
+    if (const CKeyID* pkeyid = boost::get<CKeyID>(&dest))
+    {
+        addressType = ADDRESSINDEX_PUBKEYHASH;
+        addressHash = static_cast<uint160>(*pkeyid);
+        return true;
+    }
+    if (const CScriptID* pscriptid = boost::get<CScriptID>(&dest))
+    {
+        addressType = ADDRESSINDEX_SCRIPTHASH;
+        addressHash = static_cast<uint160>(*pscriptid);
+        return true;
+    }
+    return false;
+}
+
+static bool GetAddressIndexKey(const CScript& scriptPubKey, unsigned char& addressType, uint160& addressHash)
+{
+    CTxDestination dest;
+    return ExtractDestination(scriptPubKey, dest) && GetAddressIndexKey(dest, addressType, addressHash);
+}
+
+// Add (fConnect) or remove the address unspent, address delta and spent index
+// entries of a transaction. vPrevOut holds, for every input, the output it
+// spends and the height that output was created at.
+static bool UpdateAddressIndexes(CTxDB& txdb, const CTransaction& tx, const std::vector<std::pair<CTxOut, int> >& vPrevOut, int nHeight, bool fConnect)
+{
+    uint256 hashTx = tx.GetHash();
+    unsigned char addressType;
+    uint160 addressHash;
+
+    for (unsigned int i = 0; i < vPrevOut.size(); i++)
+    {
+        const COutPoint& prevout = tx.vin[i].prevout;
+        const CTxOut& txout = vPrevOut[i].first;
+        bool fAddress = GetAddressIndexKey(txout.scriptPubKey, addressType, addressHash);
+        if (!fAddress)
+        {
+            addressType = 0;
+            addressHash = 0;
         }
-        // outputs
-        BOOST_FOREACH(const CTxOut &atxout, tx.vout) {
-            std::vector<uint160> addrIds;
-            if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-            {
-                BOOST_FOREACH(uint160 addrId, addrIds)
-                {
-                    if(!txdb.WriteAddrIndex(addrId, hashTx))
-                        LogPrintf("RebuildAddressIndex(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                }
-            }
+        if (fAddressIndex && fAddress)
+        {
+            CAddressDeltaKey keyDelta(addressType, addressHash, nHeight, hashTx, i, true);
+            CAddressUnspentKey keyUnspent(addressType, addressHash, prevout.hash, prevout.n);
+            if (fConnect ? !txdb.WriteAddressDelta(keyDelta, -txout.nValue) || !txdb.EraseAddressUnspent(keyUnspent)
+                         : !txdb.EraseAddressDelta(keyDelta) ||
+                           !txdb.WriteAddressUnspent(keyUnspent, CAddressUnspentValue(txout.nValue, txout.scriptPubKey, vPrevOut[i].second)))
+                return error("UpdateAddressIndexes() : address index update failed for %s", hashTx.ToString());
+        }
+        if (fSpentIndex)
+        {
+            if (fConnect ? !txdb.WriteSpentIndex(prevout, CSpentIndexValue(hashTx, i, nHeight, txout.nValue, addressType, addressHash))
+                         : !txdb.EraseSpentIndex(prevout))
+                return error("UpdateAddressIndexes() : spent index update failed for %s", hashTx.ToString());
+        }
+    }
+
+    if (!fAddressIndex)
+        return true;
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        if (!GetAddressIndexKey(txout.scriptPubKey, addressType, addressHash))
+            continue;
+        CAddressDeltaKey keyDelta(addressType, addressHash, nHeight, hashTx, i, false);
+        CAddressUnspentKey keyUnspent(addressType, addressHash, hashTx, i);
+        if (fConnect ? !txdb.WriteAddressDelta(keyDelta, txout.nValue) ||
+                       !txdb.WriteAddressUnspent(keyUnspent, CAddressUnspentValue(txout.nValue, txout.scriptPubKey, nHeight))
+                     : !txdb.EraseAddressDelta(keyDelta) || !txdb.EraseAddressUnspent(keyUnspent))
+            return error("UpdateAddressIndexes() : address index update failed for %s", hashTx.ToString());
+    }
+    return true;
+}
+
+// Outputs spent by a transaction in the main chain, with their heights, read
+// through the coins records
+static bool GetPrevOutputs(CTxDB& txdb, const CTransaction& tx, std::vector<std::pair<CTxOut, int> >& vPrevOut)
+{
+    vPrevOut.clear();
+    if (tx.IsCoinBase())
+        return true;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        CCoins coins;
+        CTxIndex txindex;
+        if (!GetCoins(txdb, txin.prevout.hash, coins, txindex) || txin.prevout.n >= coins.vout.size())
+            return error("GetPrevOutputs() : cannot find %s", txin.prevout.ToString());
+        vPrevOut.push_back(make_pair(coins.vout[txin.prevout.n], coins.nHeight));
+    }
+    return true;
+}
+
+bool RebuildAddressIndexes()
+{
+    CTxDB txdb("r+");
+    if (!txdb.WipeAddressIndexes())
+        return false;
+
+    // The unspent index depends on every earlier spend, so the main chain is
+    // replayed from the genesis block up
+    int64_t nStart = GetTimeMillis();
+    for (int nHeight = 0; nHeight <= nBestHeight; nHeight++)
+    {
+        boost::this_thread::interruption_point();
+        if (nHeight % 1000 == 0)
+            uiInterface.InitMessage(strprintf(_("Rebuilding address indexes, block %d"), nHeight));
+
+        CBlockIndex* pindex = FindBlockByHeight(nHeight);
+        CBlock block;
+        if (!pindex || !block.ReadFromDisk(pindex, true))
+            return error("RebuildAddressIndexes() : cannot read block %d", nHeight);
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            std::vector<std::pair<CTxOut, int> > vPrevOut;
+            if (!GetPrevOutputs(txdb, tx, vPrevOut) || !UpdateAddressIndexes(txdb, tx, vPrevOut, nHeight, true))
+                return false;
         }
+        if (!pcoinsTip->Flush(txdb) || !txdb.Commit())
+            return error("RebuildAddressIndexes() : commit failed");
+    }
+    if (!txdb.WriteFlag("addressindex", fAddressIndex) || !txdb.WriteFlag("spentindex", fSpentIndex) || !txdb.Commit(true))
+        return error("RebuildAddressIndexes() : commit failed");
+
+    LogPrintf("RebuildAddressIndexes() : indexed %d blocks in %dms\n", nBestHeight + 1, GetTimeMillis() - nStart);
+    return true;
+}
+
+void CBlock::RebuildAddressIndex(CTxDB& txdb, int nHeight)
+{
+    BOOST_FOREACH(CTransaction& tx, vtx)
+    {
+        if (!WriteTxAddrIndex(txdb, tx, nHeight))
+            return;
     }
 }
 
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
+    int64_t nTimeStart = GetTimeMicros();
+
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
     if (!CheckBlock(!fJustCheck, !fJustCheck, false))
     {
@@ -2389,6 +2773,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    CBlockUndo undo;
+    std::vector<std::vector<std::pair<CTxOut, int> > > vTxPrevOut;
+    if (fAddressIndex || fSpentIndex)
+        vTxPrevOut.resize(vtx.size());
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -2396,9 +2784,15 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     unsigned int nSigOps = 0;
     int nInputs = 0;
 
+    // Script checks of the whole block are handed to the -par workers as the
+    // transactions are connected, and collected before anything is written
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    int64_t nStartScriptChecks = GetTimeMicros();
+
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
-        uint256 hashTx = tx.GetHash();
+        // CheckBlock above built the merkle tree from these transactions
+        uint256 hashTx = GetTxHash(&tx - &vtx[0]);
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
 
@@ -2407,7 +2801,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
         if (!fJustCheck)
+        {
             nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+            // Records are tied to posThisTx, so one left behind by a block
+            // that fails to connect is never used
+            pcoinsTip->SetCoins(hashTx, CCoins(tx, posThisTx, pindex->nHeight, GetBlockTime()));
+            if (ptxCache)
+                ptxCache->Add(hashTx, posThisTx, tx);
+        }
 
         MapPrevTx mapInputs;
         if (tx.IsCoinBase())
@@ -2418,6 +2819,12 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
                 return false;
 
+            // Remember the index entries of previous transactions as they were
+            // before this block touched them
+            for (MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
+                if (!mapQueuedChanges.count((*mi).first))
+                    undo.vPrevTxIndex.push_back(make_pair((*mi).first, (*mi).second.first));
+
             // Add in sigops done by pay-to-script-hash inputs;
             // this is to prevent a "rogue miner" from creating
             // an incredibly-expensive-to-validate block.
@@ -2435,13 +2842,30 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
                 nStakeReward = nTxValueOut - nTxValueIn;
 
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, true, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
+
+            // Outputs this transaction spends, for the address indexes
+            if (!vTxPrevOut.empty())
+            {
+                std::vector<std::pair<CTxOut, int> >& vPrevOut = vTxPrevOut[&tx - &vtx[0]];
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    vPrevOut.push_back(make_pair(mapInputs[txin.prevout.hash].second->vout[txin.prevout.n], -1));
+            }
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    // As when a script fails inline in ConnectInputs, the block itself is
+    // not scored; the failing input has been logged by CScriptCheck
+    if (!control.Wait())
+        return error("ConnectBlock() : %s script verification failed", GetHash().ToString());
+    if (nScriptCheckThreads)
+        LogPrint("bench", "    - Verify %u inputs: %.2fms\n", nInputs, (GetTimeMicros() - nStartScriptChecks) * 0.001);
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(pindex->nHeight, nFees);
@@ -2506,55 +2930,54 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     {
         if (!txdb.UpdateTxIndex((*mi).first, (*mi).second))
             return error("ConnectBlock() : UpdateTxIndex failed");
+
+        // Nothing left to spend, drop the coins record
+        bool fAllSpent = true;
+        BOOST_FOREACH(const CDiskTxPos& posSpent, (*mi).second.vSpent)
+        {
+            if (posSpent.IsNull())
+            {
+                fAllSpent = false;
+                break;
+            }
+        }
+        if (!fAllSpent)
+            continue;
+
+        // DisconnectBlock puts the record back from the undo data, since
+        // the block file it would otherwise be rebuilt from may get pruned
+        CCoins coins;
+        if (!pcoinsTip->GetCoins(txdb, (*mi).first, (*mi).second, coins))
+            continue;
+        undo.vPrevCoins.push_back(make_pair((*mi).first, coins));
+        pcoinsTip->EraseCoins((*mi).first);
     }
 
-    if(GetBoolArg("-addrindex", false))
+    if(fAddrIndex)
     {
         // Write Address Index
         BOOST_FOREACH(CTransaction& tx, vtx)
         {
-            uint256 hashTx = tx.GetHash();
-            // inputs
-            if(!tx.IsCoinBase())
-            {
-                MapPrevTx mapInputs;
-                map<uint256, CTxIndex> mapQueuedChangesT;
-                bool fInvalid;
-                if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-                    return false;
+            if (!WriteTxAddrIndex(txdb, tx, pindex->nHeight, &undo.vAddrIndex))
+                return false;
+        }
+    }
 
-                MapPrevTx::const_iterator mi;
-                for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-                {
-                    BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-                    {
-                        std::vector<uint160> addrIds;
-                        if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                        {
-                            BOOST_FOREACH(uint160 addrId, addrIds)
-                            {
-                                if(!txdb.WriteAddrIndex(addrId, hashTx))
-                                    LogPrintf("ConnectBlock(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                            }
-                        }
-                    }
-                }
-            }
+    for (unsigned int i = 0; i < vTxPrevOut.size(); i++)
+        if (!UpdateAddressIndexes(txdb, vtx[i], vTxPrevOut[i], pindex->nHeight, true))
+            return false;
 
-            // outputs
-            BOOST_FOREACH(const CTxOut &atxout, tx.vout)
-            {
-                std::vector<uint160> addrIds;
-                if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                {
-                    BOOST_FOREACH(uint160 addrId, addrIds)
-                    {
-                        if(!txdb.WriteAddrIndex(addrId, hashTx))
-                            LogPrintf("ConnectBlock(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                    }
-                }
-            }
-        }
+    // Blocks up to the last checkpoint are never disconnected
+    if (pindex->nHeight > Checkpoints::GetTotalBlocksEstimate() && !txdb.WriteBlockUndo(pindex->GetBlockHash(), undo))
+        return error("ConnectBlock() : WriteBlockUndo failed");
+
+    // Undo records are kept as deep as reorganizations are expected to reach.
+    // A block below that is still taken back through DisconnectInputs.
+    if (pindex->pprev && pindex->nHeight > MIN_BLOCKS_TO_KEEP)
+    {
+        CBlockIndex* pindexExpired = pindex->pprev->GetAncestor(pindex->nHeight - MIN_BLOCKS_TO_KEEP);
+        if (pindexExpired)
+            txdb.EraseBlockUndo(pindexExpired->GetBlockHash());
     }
 
     // Update block index on disk without changing it in memory.
@@ -2567,6 +2990,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : WriteBlockIndex failed");
     }
 
+    LogPrint("bench", "ConnectBlock() : %s %u txs, %d inputs in %.2fms\n", GetHash().ToString(), vtx.size(), nInputs, (GetTimeMicros() - nTimeStart) * 0.001);
+
     // Watch for transactions paying to me
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this);
@@ -2580,21 +3005,21 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     CBlockIndex* pfork = pindexBest;
     CBlockIndex* plonger = pindexNew;
 
+    // Bring both branches to the same height through the skip pointers,
+    // then walk back together until they meet
+    if (plonger->nHeight > pfork->nHeight)
+        plonger = plonger->GetAncestor(pfork->nHeight);
+    else if (pfork->nHeight > plonger->nHeight)
+        pfork = pfork->GetAncestor(plonger->nHeight);
+    if (!pfork || !plonger)
+        return error("Reorganize() : branch ancestor is null");
+
     while (pfork != plonger)
     {
-        while (plonger->nHeight > pfork->nHeight)
-        {
-            MilliSleep(1); /* RGP Optimize */
-            if (!(plonger = plonger->pprev))
-                return error("Reorganize() : plonger->pprev is null");
-        }
-
-        if (pfork == plonger)
-            break;
-        if (!(pfork = pfork->pprev))
+        pfork = pfork->pprev;
+        plonger = plonger->pprev;
+        if (!pfork || !plonger)
             return error("Reorganize() : pfork->pprev is null");
-
-        MilliSleep(1); /* RGP Optimize */
     }
 
     // List of what to disconnect
@@ -2614,6 +3039,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     }
 
     // Disconnect shorter branch
+    int64_t nDisconnectStart = GetTimeMicros();
     list<CTransaction> vResurrect;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
     {
@@ -2630,6 +3056,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
             if (!(tx.IsCoinBase() || tx.IsCoinStake()) && pindex->nHeight > Checkpoints::GetTotalBlocksEstimate())
                 vResurrect.push_front(tx);
     }
+    LogPrint("bench", "Reorganize() : disconnected %u blocks in %.2fms\n", vDisconnect.size(), (GetTimeMicros() - nDisconnectStart) * 0.001);
 
     // Connect longer branch
     vector<CTransaction> vDelete;
@@ -2789,12 +3216,16 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    SetActiveChain(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
+    // Write the coins cache out once it has grown past -dbcache
+    if (!pcoinsTip->Flush(txdb))
+        LogPrintf("SetBestChain() : failed to flush coins cache\n");
+
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
     if (fDebug ){
@@ -2854,24 +3285,24 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64
     BOOST_FOREACH(const CTxIn& txin, vin)
     {
         // First try finding the previous transaction in database
-        CTransaction txPrev;
         CTxIndex txindex;
-        if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+        if (!txdb.ReadTxIndex(txin.prevout.hash, txindex))
             continue;  // previous transaction not in main chain
-        if (nTime < txPrev.nTime)
+        CCoins coins;
+        if (!pcoinsTip->GetCoins(txdb, txin.prevout.hash, txindex, coins))
+            continue;  // unable to read previous transaction
+        if (txin.prevout.n >= coins.vout.size())
+            continue;
+        if (nTime < coins.nTime)
             return false;  // Transaction timestamp violation
 
-        // Read block header
-        CBlock block;
-        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-            return false; // unable to read block of previous transaction
-        if (block.GetBlockTime() + nStakeMinAge > nTime)
+        if ((int64_t)coins.nBlockTime + nStakeMinAge > nTime)
             continue; // only count coins meeting min age requirement
 
-        int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-        bnCentSecond += CBigNum(nValueIn) * (nTime-txPrev.nTime) / CENT;
+        int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
+        bnCentSecond += CBigNum(nValueIn) * (nTime-coins.nTime) / CENT;
 
-        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, nTime - txPrev.nTime, bnCentSecond.ToString());
+        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, nTime - coins.nTime, bnCentSecond.ToString());
     }
 
     CBigNum bnCoinDay = bnCentSecond * CENT / COIN / (24 * 60 * 60);
@@ -2890,15 +3321,14 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (AllocBlockIndex()) CBlockIndex(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
 
     // ppcoin: compute chain trust score
@@ -2919,7 +3349,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
     
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2932,11 +3362,16 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     if (!txdb.TxnCommit())
         return false;
 
+    NoteBlockFileHeight(nFile, pindexNew->nHeight);
+
     // New best
     if (pindexNew->nChainTrust > nBestChainTrust)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
+    if (pindexNew == pindexBest)
+        PruneBlockFiles();
+
     if (pindexNew == pindexBest)
     {
         // Notify UI to display prev block's coinbase if it was ours
@@ -2948,11 +3383,17 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     return true;
 }
 
-bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) const
+// The checks that need nothing but the block itself. They can run on any
+// thread, without cs_main, ahead of connecting the block.
+bool CBlock::CheckBlockContextFree(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) const
 {
-    // These are checks that are independent of context
-    // that can be verified before saving an orphan block.
+    return CheckBlockHeaderContextFree(fCheckPOW, fCheckSig) && CheckBlockTransactions(fCheckMerkleRoot);
+}
 
+// Sizes, proof of work, timestamp, the coinbase and coinstake layout and the
+// block signature
+bool CBlock::CheckBlockHeaderContextFree(bool fCheckPOW, bool fCheckSig) const
+{
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return DoS(100, error("CheckBlock() : size limits failed"));
@@ -2990,23 +3431,87 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     if (fCheckSig && !CheckBlockSignature())
         return DoS(100, error("CheckBlock() : bad proof-of-stake block signature"));
 
+    return true;
+}
 
-// ----------- instantX transaction scanning -----------
+// Every transaction on its own, duplicates, sigops and the merkle root
+bool CBlock::CheckBlockTransactions(bool fCheckMerkleRoot) const
+{
+    // Check transactions
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        if (!tx.CheckTransaction())
+        {
 
-    if(IsSporkActive(SPORK_3_INSTANTX_BLOCK_FILTERING)){
-        BOOST_FOREACH(const CTransaction& tx, vtx){
-            if (!tx.IsCoinBase()){
-                //only reject blocks when it's based on complete consensus
-                BOOST_FOREACH(const CTxIn& in, tx.vin){
-                    if(mapLockedInputs.count(in.prevout)){
-                        if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                            if(fDebug) { LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString().c_str(), tx.GetHash().ToString().c_str()); }
-                            return DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"));
-                        }
-                    }
-                }
-            }
-        }
+            LogPrintf("\n\n*** RGP CHECKBLOCK Checktransaction failed \n\n");
+
+            return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
+        }
+
+        // ppcoin: check transaction timestamp
+        if (GetBlockTime() < (int64_t)tx.nTime)
+        {
+            LogPrintf("\n\n*** RGP CHECKBLOCK block time INVALID failed \n\n");
+
+            return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
+        }
+    }
+
+    // Hash every transaction once; the duplicate check and the merkle root
+    // check below, and ConnectBlock after them, read the leaves of the tree
+    uint256 hashMerkleRootBuilt = BuildMerkleTree();
+
+    // Check for duplicate txids. This is caught by ConnectInputs(),
+    // but catching it earlier avoids a potential DoS attack:
+    set<uint256> uniqueTx;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        uniqueTx.insert(GetTxHash(i));
+    if (uniqueTx.size() != vtx.size())
+        return DoS(100, error("CheckBlock() : duplicate transaction"));
+
+    unsigned int nSigOps = 0;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        nSigOps += GetLegacySigOpCount(tx);
+    }
+    if (nSigOps > MAX_BLOCK_SIGOPS)
+        return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
+
+    // Check merkle root
+    if (fCheckMerkleRoot && hashMerkleRoot != hashMerkleRootBuilt)
+        return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
+
+
+    return true;
+}
+
+bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) const
+{
+    // These are checks that can be verified before saving an orphan block.
+    // The instantX and masternode payment checks sit between the header and
+    // the transaction checks, so a block failing more than one is scored the
+    // same as ever. Blocks imported from a file passed the context free ones
+    // on a worker thread already.
+
+    if (!fChecked && !CheckBlockHeaderContextFree(fCheckPOW, fCheckSig))
+        return false;
+
+// ----------- instantX transaction scanning -----------
+
+    if(IsSporkActive(SPORK_3_INSTANTX_BLOCK_FILTERING)){
+        BOOST_FOREACH(const CTransaction& tx, vtx){
+            if (!tx.IsCoinBase()){
+                //only reject blocks when it's based on complete consensus
+                BOOST_FOREACH(const CTxIn& in, tx.vin){
+                    if(mapLockedInputs.count(in.prevout)){
+                        if(mapLockedInputs[in.prevout] != tx.GetHash()){
+                            if(fDebug) { LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString().c_str(), tx.GetHash().ToString().c_str()); }
+                            return DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"));
+                        }
+                    }
+                }
+            }
+        }
     } else{
         if(fDebug) { LogPrintf("CheckBlock() : skipping transaction locking checks\n"); }
     }
@@ -3116,49 +3621,8 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         if(fDebug) { LogPrintf("CheckBlock() : Is initial download, skipping masternode payment check %d\n", pindexBest->nHeight+1); }
     }
 
-
-    // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        if (!tx.CheckTransaction())
-        {
-
-            LogPrintf("\n\n*** RGP CHECKBLOCK Checktransaction failed \n\n");
-
-            return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
-        }
-
-        // ppcoin: check transaction timestamp
-        if (GetBlockTime() < (int64_t)tx.nTime)
-        {
-            LogPrintf("\n\n*** RGP CHECKBLOCK block time INVALID failed \n\n");
-
-            return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
-        }
-    }
-
-    // Check for duplicate txids. This is caught by ConnectInputs(),
-    // but catching it earlier avoids a potential DoS attack:
-    set<uint256> uniqueTx;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        uniqueTx.insert(tx.GetHash());
-    }
-    if (uniqueTx.size() != vtx.size())
-        return DoS(100, error("CheckBlock() : duplicate transaction"));
-
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        nSigOps += GetLegacySigOpCount(tx);
-    }
-    if (nSigOps > MAX_BLOCK_SIGOPS)
-        return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
-
-    // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
-        return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
-
+    if (!fChecked && !CheckBlockTransactions(fCheckMerkleRoot))
+        return false;
 
     return true;
 }
@@ -3182,7 +3646,8 @@ uint256 hash;
     if (mapBlockIndex.count(hash))
     {
         /* We have the new block, try to get blocks from pindexbest */        
-        PushGetBlocks(From_Node, pindexBest, pindexBest->GetBlockHash() ); /* ask for again from best block */
+        if (From_Node)
+            PushGetBlocks(From_Node, pindexBest, pindexBest->GetBlockHash() ); /* ask for again from best block */
         MilliSleep( 1 );
 
         LogPrintf("*** RGP Debug Accept() Block already in MapBlockIndex \n");
@@ -3193,7 +3658,7 @@ uint256 hash;
     else
     {
         // Get prev block index
-        map<uint256, CBlockIndex*>::iterator mi_second = mapBlockIndex.find(hashPrevBlock);
+        BlockMap::iterator mi_second = mapBlockIndex.find(hashPrevBlock);
         if (mi_second == mapBlockIndex.end())
         {
             /* The blockhash was not found in the local store, look for
@@ -3202,14 +3667,15 @@ uint256 hash;
             /* Creare and inventory request message, it will result in a block being returned */
             Inventory_to_Request.type = MSG_BLOCK;
             Inventory_to_Request.hash = hashPrevBlock;
-            From_Node->AskFor( Inventory_to_Request, false );
+            if (From_Node)
+                From_Node->AskFor( Inventory_to_Request, false );
 
             //LogPrintf("AcceptBlock() : prev block not found \n");
             return false;
         }
     }
 
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     CBlockIndex* pindexPrev = (*mi).second;
     int nHeight = pindexPrev->nHeight+1;
 
@@ -3299,7 +3765,8 @@ uint256 hash;
             //{
 
             /* Ask for missing blocks */
-            PushGetBlocks(From_Node, pindexBest, pindexBest->GetBlockHash() );
+            if (From_Node)
+                PushGetBlocks(From_Node, pindexBest, pindexBest->GetBlockHash() );
 
             LogPrintf(" RGP CheckProofofStake fix best block is %d \n ", pindexBest->nHeight );
             //switch (pindexBest->nHeight )
@@ -3358,7 +3825,7 @@ uint256 hash;
         return error("AcceptBlock() : WriteToDisk failed");
     if (!AddToBlockIndex(nFile, nBlockPos, hashProof))
     {
-        LogPrintf("*** RGP Acceptblock, Invalid block from wallet node %s \n", From_Node->addr.ToString());
+        LogPrintf("*** RGP Acceptblock, Invalid block from wallet node %s \n", From_Node ? From_Node->addr.ToString() : "(local)");
         return error("AcceptBlock() : AddToBlockIndex failed");
     }
 
@@ -3397,6 +3864,60 @@ uint256 CBlockIndex::GetBlockTrust() const
     return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
 }
 
+// Turn the lowest '1' bit in the binary representation of a number into a '0'
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// Compute what height to jump back to with the CBlockIndex::pskip pointer
+static inline int GetSkipHeight(int height)
+{
+    if (height < 2)
+        return 0;
+
+    // Determine which height to jump back to. Any number strictly lower than height is acceptable,
+    // but the following expression seems to perform well in simulations (max 110 steps to go back
+    // up to 2**18 blocks).
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn)
+{
+    if (nHeightIn > nHeight || nHeightIn < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > nHeightIn)
+    {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == nHeightIn ||
+             (heightSkip > nHeightIn && !(heightSkipPrev < heightSkip - 2 && heightSkipPrev >= nHeightIn))))
+        {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev.
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        }
+        else
+        {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightIn);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
 {
 static char filter_counter = 0;
@@ -3562,6 +4083,10 @@ bool PoS_Mining_Block, Accept_Status;
 
         if (!Accept_Status)
         {
+            // Mined or imported, there is no one to ask for the parent
+            if (pfrom == NULL)
+                return false;
+
             LogPrintf("*** RGP ProcessBlock failed from %s \n", pfrom->addr.ToString() );
 
             /* Previous block is missing, let's ask for it. However, this will repeat
@@ -4098,108 +4623,882 @@ int64_t nSearchTime;
         nLastCoinStakeSearchTime = nSearchTime;
     }
 
-
-    return false;
+
+    return false;
+}
+#endif
+
+bool CBlock::CheckBlockSignature() const
+{
+    if (IsProofOfWork())
+        return vchBlockSig.empty();
+
+    if (vchBlockSig.empty())
+        return false;
+
+    vector<valtype> vSolutions;
+    txnouttype whichType;
+
+    const CTxOut& txout = vtx[1].vout[1];
+
+    if (!Solver(txout.scriptPubKey, whichType, vSolutions))
+        return false;
+
+    if (whichType == TX_PUBKEY)
+    {
+        valtype& vchPubKey = vSolutions[0];
+        return CPubKey(vchPubKey).Verify(GetHash(), vchBlockSig);
+    }
+
+    return false;
+}
+
+bool CheckDiskSpace(uint64_t nAdditionalBytes)
+{
+    uint64_t nFreeBytesAvailable = filesystem::space(GetDataDir()).available;
+
+    // Check for nMinDiskSpace bytes (currently 50MB)
+    if (nFreeBytesAvailable < nMinDiskSpace + nAdditionalBytes)
+    {
+        string strMessage = _("Error: Disk space is low!");
+        strMiscWarning = strMessage;
+        LogPrintf("*** %s\n", strMessage);
+        uiInterface.ThreadSafeMessageBox(strMessage, "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        return false;
+    }
+    return true;
+}
+
+static filesystem::path BlockFilePath(unsigned int nFile)
+{
+    string strBlockFn = strprintf("blk%04u.dat", nFile);
+    return GetDataDir() / strBlockFn;
+}
+
+FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
+{
+    if ((nFile < 1) || (nFile & SNAPSHOT_BLOCK_FILE))
+        return NULL;
+    FILE* file = fopen(BlockFilePath(nFile).string().c_str(), pszMode);
+    if (!file)
+        return NULL;
+    if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
+    {
+        if (!FileSeek(file, nBlockPos))
+        {
+            fclose(file);
+            return NULL;
+        }
+    }
+    return file;
+}
+
+// Idle read handles on the block files, least recently used first. A reader
+// takes a handle out of the list and puts it back when it is done, so the
+// lock is only held around the list operations and reads run concurrently.
+static const unsigned int MAX_BLOCKFILE_HANDLES = 8;
+static CCriticalSection cs_BlockFileHandles;
+static list<pair<unsigned int, FILE*> > lBlockFileHandles;
+static unsigned int nBlockFileHandlesOpen = 0;
+// Bumped by CloseBlockFileHandles, so handles out with a reader at the time
+// are closed when they come back instead of returning to the list
+static unsigned int nBlockFileHandleEpoch = 0;
+static uint64_t nBlockFileHandleHits = 0;
+static uint64_t nBlockFileHandleMisses = 0;
+
+CBlockFileReader::CBlockFileReader(unsigned int nFileIn, unsigned int nPos) : CAutoFile(NULL, SER_DISK, CLIENT_VERSION)
+{
+    nFile = nFileIn;
+    fileBorrowed = NULL;
+    FILE* filecached = NULL;
+    {
+        LOCK(cs_BlockFileHandles);
+        nEpoch = nBlockFileHandleEpoch;
+        list<pair<unsigned int, FILE*> >::reverse_iterator it = lBlockFileHandles.rbegin();
+        while (it != lBlockFileHandles.rend() && it->first != nFile)
+            ++it;
+        if (it != lBlockFileHandles.rend())
+        {
+            nBlockFileHandleHits++;
+            filecached = it->second;
+            lBlockFileHandles.erase(--it.base());
+        }
+        else
+            nBlockFileHandleMisses++;
+    }
+
+    if (!filecached)
+    {
+        filecached = OpenBlockFile(nFile, 0, "rb");
+        if (!filecached)
+            return;
+        LOCK(cs_BlockFileHandles);
+        nBlockFileHandlesOpen++;
+    }
+
+    // The stdio buffer is dropped by the seek, so data appended to the file
+    // through another handle since the last read is visible
+    clearerr(filecached);
+    file = filecached;
+    if (!FileSeek(filecached, nPos))
+        file = NULL;
+    fileBorrowed = filecached;
+}
+
+CBlockFileReader::~CBlockFileReader()
+{
+    release();
+    if (!fileBorrowed)
+        return;
+
+    FILE* fileClose = fileBorrowed;
+    {
+        LOCK(cs_BlockFileHandles);
+        if (nEpoch == nBlockFileHandleEpoch)
+        {
+            lBlockFileHandles.push_back(make_pair(nFile, fileBorrowed));
+            fileClose = NULL;
+            if (lBlockFileHandles.size() > MAX_BLOCKFILE_HANDLES)
+            {
+                fileClose = lBlockFileHandles.front().second;
+                lBlockFileHandles.pop_front();
+            }
+        }
+        if (fileClose)
+            nBlockFileHandlesOpen--;
+    }
+    if (fileClose)
+        ::fclose(fileClose);
+}
+
+void CloseBlockFileHandles(unsigned int nFile)
+{
+    LOCK(cs_BlockFileHandles);
+    nBlockFileHandleEpoch++;
+    list<pair<unsigned int, FILE*> >::iterator it = lBlockFileHandles.begin();
+    while (it != lBlockFileHandles.end())
+    {
+        if (nFile == (unsigned int)-1 || it->first == nFile)
+        {
+            fclose(it->second);
+            nBlockFileHandlesOpen--;
+            it = lBlockFileHandles.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+void GetBlockFileCacheStats(uint64_t& nHitsRet, uint64_t& nMissesRet, unsigned int& nOpenRet)
+{
+    LOCK(cs_BlockFileHandles);
+    nHitsRet = nBlockFileHandleHits;
+    nMissesRet = nBlockFileHandleMisses;
+    nOpenRet = nBlockFileHandlesOpen;
+}
+
+// Blocks are stored after a two word header, with nBlockPos pointing past it:
+//   plain: [message start][size][block]
+//   LZ4:   [message start][size][compressed size | BLOCK_LZ4_FLAG][LZ4 data]
+// For an LZ4 record the size is that of the decompressed block, so the two
+// words in front of nBlockPos tell both formats apart. Transaction positions
+// in a compressed block are offsets into the decompressed data.
+static const unsigned int BLOCK_RECORD_HEADER_SIZE = 2 * sizeof(unsigned int);
+
+static CCriticalSection cs_BlockCompressionStats;
+static uint64_t nCompressRawBytes = 0;
+static uint64_t nCompressStoredBytes = 0;
+static int64_t nCompressTime = 0;
+static uint64_t nDecompressBytes = 0;
+static int64_t nDecompressTime = 0;
+
+// Read the words in front of the block record at the position of filein. For an
+// LZ4 record nSizeRet bytes of compressed data follow, otherwise the block itself.
+static bool ReadBlockRecordHeader(CAutoFile& filein, unsigned int& nSizeRet, unsigned int& nRawSizeRet, bool& fCompressedRet)
+{
+    unsigned char pchWord[MESSAGE_START_SIZE];
+    unsigned int nLength;
+    filein >> FLATDATA(pchWord) >> nLength;
+
+    fCompressedRet = (nLength & BLOCK_LZ4_FLAG) != 0;
+    if (fCompressedRet)
+    {
+        nSizeRet = nLength & ~BLOCK_LZ4_FLAG;
+        memcpy(&nRawSizeRet, pchWord, sizeof(nRawSizeRet));
+    }
+    else
+    {
+        if (memcmp(pchWord, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+            return error("ReadBlockRecordHeader() : bad message start");
+        nSizeRet = nRawSizeRet = nLength;
+    }
+    if (nSizeRet == 0 || nSizeRet > MAX_BLOCK_SIZE || nRawSizeRet > MAX_BLOCK_SIZE)
+        return error("ReadBlockRecordHeader() : bad block size %u", nSizeRet);
+    return true;
+}
+
+// Decompress at least the first nWant bytes of an LZ4 block. pchOut must have
+// room for the whole block, nRawSize bytes.
+static bool DecompressBlockData(const char* pchIn, unsigned int nSize, char* pchOut, unsigned int nRawSize, unsigned int nWant)
+{
+    int64_t nStart = GetTimeMicros();
+    int nOut;
+    if (nWant < nRawSize)
+        nOut = LZ4_decompress_safe_partial(pchIn, pchOut, nSize, nWant, nRawSize);
+    else
+        nOut = LZ4_decompress_safe(pchIn, pchOut, nSize, nRawSize);
+    if (nOut < (int)nWant || nOut > (int)nRawSize)
+        return error("DecompressBlockData() : LZ4 data is corrupt");
+
+    LOCK(cs_BlockCompressionStats);
+    nDecompressBytes += nOut;
+    nDecompressTime += GetTimeMicros() - nStart;
+    return true;
+}
+
+// Read the LZ4 data that follows a record header into s, decompressing the
+// first nWant bytes of the block or all of it
+static void ReadCompressedBlock(CAutoFile& filein, unsigned int nSize, unsigned int nRawSize, unsigned int nWant, CDataStream& s)
+{
+    std::vector<char> vchCompressed(nSize);
+    filein.read(&vchCompressed[0], nSize);
+
+    nWant = std::min(nWant, nRawSize);
+    size_t nStart = s.size();
+    s.resize(nStart + nRawSize);
+    if (!DecompressBlockData(&vchCompressed[0], nSize, &s[nStart], nRawSize, nWant))
+    {
+        s.resize(nStart);
+        throw std::runtime_error("ReadCompressedBlock() : decompression failed");
+    }
+    s.resize(nStart + nWant);
+}
+
+bool ReadRawBlockFromDisk(CDataStream& s, unsigned int nFile, unsigned int nBlockPos)
+{
+    if (nBlockPos < BLOCK_RECORD_HEADER_SIZE)
+        return error("ReadRawBlockFromDisk() : invalid block position %u", nBlockPos);
+
+    CBlockFileReader filein(nFile, nBlockPos - BLOCK_RECORD_HEADER_SIZE);
+    if (filein.IsNull())
+        return error("ReadRawBlockFromDisk() : OpenBlockFile failed");
+
+    size_t nStart = s.size();
+    try {
+        unsigned int nSize, nRawSize;
+        bool fCompressed;
+        if (!ReadBlockRecordHeader(filein, nSize, nRawSize, fCompressed))
+            return error("ReadRawBlockFromDisk() : bad block record at %u:%u", nFile, nBlockPos);
+
+        if (fCompressed)
+            ReadCompressedBlock(filein, nSize, nRawSize, nRawSize, s);
+        else
+        {
+            s.resize(nStart + nSize);
+            filein.read(&s[nStart], nSize);
+        }
+    }
+    catch (std::exception &e) {
+        s.resize(nStart);
+        return error("%s() : I/O error", __PRETTY_FUNCTION__);
+    }
+    return true;
+}
+
+bool CBlock::WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
+{
+    // Build the whole record in memory so it is appended with one write
+    unsigned int nSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
+    unsigned int nHeaderSize = MESSAGE_START_SIZE + sizeof(nSize);
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    ssRecord.reserve(nHeaderSize + nSize);
+    ssRecord << FLATDATA(Params().MessageStart()) << nSize << *this;
+
+    if (fCompressBlocks)
+    {
+        int64_t nStart = GetTimeMicros();
+        std::vector<char> vchCompressed(LZ4_compressBound(nSize));
+        int nCompressed = LZ4_compress(&ssRecord[nHeaderSize], &vchCompressed[0], nSize);
+
+        // Blocks that do not shrink are stored as they are
+        unsigned int nStored = nSize;
+        if (nCompressed > 0 && (unsigned int)nCompressed < nSize)
+        {
+            nStored = nCompressed;
+            ssRecord.resize(nHeaderSize);
+            ssRecord << (nStored | BLOCK_LZ4_FLAG);
+            ssRecord.write(&vchCompressed[0], nStored);
+            nHeaderSize += sizeof(nStored);
+        }
+
+        LOCK(cs_BlockCompressionStats);
+        nCompressRawBytes += nSize;
+        nCompressStoredBytes += nStored;
+        nCompressTime += GetTimeMicros() - nStart;
+    }
+
+    unsigned int nRecordPos;
+    if (!AppendBlockFile(&ssRecord[0], ssRecord.size(), nFileRet, nRecordPos))
+        return error("CBlock::WriteToDisk() : AppendBlockFile failed");
+    nBlockPosRet = nRecordPos + nHeaderSize;
+
+    // The data is synced at the next commit point
+    NoteBlockWrite(nFileRet, ssRecord.size());
+
+    return true;
+}
+
+bool CBlock::ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions)
+{
+    SetNull();
+
+    if (nBlockPos < BLOCK_RECORD_HEADER_SIZE)
+        return error("CBlock::ReadFromDisk() : invalid block position %u", nBlockPos);
+
+    // Open history file to read
+    CBlockFileReader filein(nFile, nBlockPos - BLOCK_RECORD_HEADER_SIZE);
+    if (filein.IsNull())
+        return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+    int nType = SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY);
+
+    // Read block
+    try {
+        unsigned int nSize, nRawSize;
+        bool fCompressed;
+        if (!ReadBlockRecordHeader(filein, nSize, nRawSize, fCompressed))
+            return error("CBlock::ReadFromDisk() : bad block record at %u:%u", nFile, nBlockPos);
+
+        if (fCompressed)
+        {
+            // The header alone only needs the start of the block decompressed
+            unsigned int nWant = fReadTransactions ? nRawSize : ::GetSerializeSize(*this, nType, CLIENT_VERSION);
+            CDataStream ss(nType, CLIENT_VERSION);
+            ReadCompressedBlock(filein, nSize, nRawSize, nWant, ss);
+            ss >> *this;
+        }
+        else
+        {
+            filein.nType = nType;
+            filein >> *this;
+        }
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+
+    // Check the header
+    if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
+        return error("CBlock::ReadFromDisk() : errors in block header");
+
+    return true;
+}
+
+// The block last decompressed to read a transaction from. The transactions of
+// a block tend to be read one after another, as when validating a block that
+// spends several of them, and each read after the first skips the LZ4 work.
+static CCriticalSection cs_LastDecompressedBlock;
+static unsigned int nLastDecompressedFile = (unsigned int)-1;
+static unsigned int nLastDecompressedPos = 0;
+static std::vector<char> vchLastDecompressed;
+
+// Read the transaction at pos from the last decompressed block, if it is
+// that block
+static bool ReadFromLastDecompressed(const CDiskTxPos& pos, CTransaction& tx)
+{
+    LOCK(cs_LastDecompressedBlock);
+    if (pos.nFile != nLastDecompressedFile || pos.nBlockPos != nLastDecompressedPos)
+        return false;
+    unsigned int nOffset = pos.nTxPos - pos.nBlockPos;
+    if (nOffset >= vchLastDecompressed.size())
+        throw std::runtime_error("ReadFromLastDecompressed() : transaction position past the end of the block");
+    CDataStream ss(&vchLastDecompressed[nOffset], &vchLastDecompressed[0] + vchLastDecompressed.size(), SER_DISK, CLIENT_VERSION);
+    ss >> tx;
+    return true;
+}
+
+bool CTransaction::ReadFromDisk(CDiskTxPos pos, FILE** pfileRet)
+{
+    if (pos.nBlockPos < BLOCK_RECORD_HEADER_SIZE || pos.nTxPos < pos.nBlockPos)
+        return error("CTransaction::ReadFromDisk() : invalid position %s", pos.ToString());
+
+    if (!pfileRet)
+    {
+        try {
+            if (ReadFromLastDecompressed(pos, *this))
+                return true;
+        }
+        catch (std::exception &e) {
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+
+    CBlockFileReader filein(pos.nFile, pos.nBlockPos - BLOCK_RECORD_HEADER_SIZE);
+    if (filein.IsNull())
+        return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+    try {
+        unsigned int nSize, nRawSize;
+        bool fCompressed;
+        if (!ReadBlockRecordHeader(filein, nSize, nRawSize, fCompressed))
+            return error("CTransaction::ReadFromDisk() : bad block record at %s", pos.ToString());
+
+        if (fCompressed)
+        {
+            // nTxPos is an offset into the decompressed block, not the file
+            if (pfileRet)
+                return error("CTransaction::ReadFromDisk() : no file position for a transaction in a compressed block at %s", pos.ToString());
+
+            CDataStream ss(SER_DISK, CLIENT_VERSION);
+            ReadCompressedBlock(filein, nSize, nRawSize, nRawSize, ss);
+            {
+                LOCK(cs_LastDecompressedBlock);
+                vchLastDecompressed.assign(ss.begin(), ss.end());
+                nLastDecompressedFile = pos.nFile;
+                nLastDecompressedPos = pos.nBlockPos;
+            }
+            ss.ignore(pos.nTxPos - pos.nBlockPos);
+            ss >> *this;
+            return true;
+        }
+
+        if (!FileSeek(filein.Get(), pos.nTxPos))
+            return error("CTransaction::ReadFromDisk() : fseek failed");
+        filein >> *this;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+    if (!pfileRet)
+        return true;
+
+    // Hand out a handle of its own, positioned at the transaction
+    FILE* file = OpenBlockFile(pos.nFile, 0, "rb+");
+    if (!file)
+        return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+    if (!FileSeek(file, pos.nTxPos))
+    {
+        fclose(file);
+        return error("CTransaction::ReadFromDisk() : fseek failed");
+    }
+    *pfileRet = file;
+    return true;
+}
+
+void GetBlockCompressionStats(uint64_t& nRawBytesRet, uint64_t& nStoredBytesRet, int64_t& nCompressTimeRet, uint64_t& nDecompressedBytesRet, int64_t& nDecompressTimeRet)
+{
+    LOCK(cs_BlockCompressionStats);
+    nRawBytesRet = nCompressRawBytes;
+    nStoredBytesRet = nCompressStoredBytes;
+    nCompressTimeRet = nCompressTime;
+    nDecompressedBytesRet = nDecompressBytes;
+    nDecompressTimeRet = nDecompressTime;
+}
+
+void BenchmarkBlockCompression(int nBlocks, int& nBlocksRet, uint64_t& nRawBytesRet, uint64_t& nCompressedBytesRet, int64_t& nCompressTimeRet, int64_t& nDecompressTimeRet, int64_t& nDeserializeTimeRet)
+{
+    nBlocksRet = 0;
+    nRawBytesRet = 0;
+    nCompressedBytesRet = 0;
+    nCompressTimeRet = 0;
+    nDecompressTimeRet = 0;
+    nDeserializeTimeRet = 0;
+
+    for (CBlockIndex* pindex = pindexBest; pindex && nBlocksRet < nBlocks; pindex = pindex->pprev)
+    {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        if (!HaveBlockData(pindex) || !ReadRawBlockFromDisk(ss, pindex->nFile, pindex->nBlockPos))
+            break;
+        unsigned int nSize = ss.size();
+        nBlocksRet++;
+        nRawBytesRet += nSize;
+
+        int64_t nStart = GetTimeMicros();
+        std::vector<char> vchCompressed(LZ4_compressBound(nSize));
+        int nCompressed = LZ4_compress(&ss[0], &vchCompressed[0], nSize);
+        nCompressTimeRet += GetTimeMicros() - nStart;
+
+        // Deserializing is what reading a block takes either way
+        nStart = GetTimeMicros();
+        CBlock block;
+        try {
+            ss >> block;
+        }
+        catch (std::exception &e) {
+            error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        nDeserializeTimeRet += GetTimeMicros() - nStart;
+
+        // Blocks that do not shrink are stored plain, as WriteToDisk does
+        if (nCompressed <= 0 || (unsigned int)nCompressed >= nSize)
+        {
+            nCompressedBytesRet += nSize;
+            continue;
+        }
+        nCompressedBytesRet += nCompressed;
+
+        std::vector<char> vchRaw(nSize);
+        nStart = GetTimeMicros();
+        LZ4_decompress_safe(&vchCompressed[0], &vchRaw[0], nCompressed, nSize);
+        nDecompressTimeRet += GetTimeMicros() - nStart;
+    }
+}
+
+static unsigned int nCurrentBlockFile = 1;
+
+// The block file being appended to stays open, and the write position is
+// kept here, so appending a block takes no reopen, seek or ftell. Disk space
+// is reserved ahead of the write position in BLOCKFILE_CHUNK_SIZE steps so
+// the file grows in large contiguous pieces.
+static CCriticalSection cs_BlockFileWriter;
+static FILE* fileCurrentBlock = NULL;
+static uint64_t nCurrentBlockFilePos = 0;
+static uint64_t nCurrentBlockFileReserved = 0;
+// Cleared when the filesystem refuses to reserve space, blocks are then
+// appended with plain writes
+static bool fBlockFilePreallocate = true;
+
+static uint64_t GetMaxBlockFileSize()
+{
+    if (fPruneMode)
+        return PRUNE_BLOCKFILE_SIZE;
+#ifndef WIN32
+    // Seeks cannot reach past 2 GB without a 64 bit off_t
+    if (sizeof(off_t) < 8)
+        return 0x7F000000 - MAX_SIZE;
+#endif
+    return MAX_BLOCKFILE_SIZE;
+}
+
+// Block files synced as the writer moved on from them, so the next commit
+// point does not have to open them again
+static set<unsigned int> setBlockFilesSyncedOnClose;
+
+static void CloseCurrentBlockFile()
+{
+    if (!fileCurrentBlock)
+        return;
+    fflush(fileCurrentBlock);
+    if (nCurrentBlockFileReserved > nCurrentBlockFilePos &&
+        !ReleaseFileRange(fileCurrentBlock, nCurrentBlockFilePos, nCurrentBlockFileReserved - nCurrentBlockFilePos))
+        LogPrintf("CloseCurrentBlockFile() : cannot release the space reserved past the end of blk%04u.dat: %s\n", nCurrentBlockFile, strerror(errno));
+    fclose(fileCurrentBlock);
+    fileCurrentBlock = NULL;
+    nCurrentBlockFilePos = 0;
+    nCurrentBlockFileReserved = 0;
+}
+
+bool AppendBlockFile(const char* pch, unsigned int nSize, unsigned int& nFileRet, unsigned int& nPosRet)
+{
+    LOCK(cs_BlockFileWriter);
+    while (true)
+    {
+        if (!fileCurrentBlock)
+        {
+            fileCurrentBlock = OpenBlockFile(nCurrentBlockFile, 0, "ab");
+            if (!fileCurrentBlock)
+                return error("AppendBlockFile() : cannot open blk%04u.dat", nCurrentBlockFile);
+            boost::system::error_code ec;
+            nCurrentBlockFilePos = boost::filesystem::file_size(BlockFilePath(nCurrentBlockFile), ec);
+            if (ec)
+            {
+                CloseCurrentBlockFile();
+                return error("AppendBlockFile() : cannot size blk%04u.dat", nCurrentBlockFile);
+            }
+            nCurrentBlockFileReserved = nCurrentBlockFilePos;
+        }
+
+        // An empty file takes any block
+        if (nCurrentBlockFilePos == 0 || nCurrentBlockFilePos + nSize <= GetMaxBlockFileSize())
+            break;
+        FileCommit(fileCurrentBlock);
+        setBlockFilesSyncedOnClose.insert(nCurrentBlockFile);
+        CloseCurrentBlockFile();
+        nCurrentBlockFile++;
+    }
+
+    if (fBlockFilePreallocate && nCurrentBlockFilePos + nSize > nCurrentBlockFileReserved)
+    {
+        uint64_t nEnd = std::min(nCurrentBlockFilePos + std::max(nSize, BLOCKFILE_CHUNK_SIZE), std::max(GetMaxBlockFileSize(), nCurrentBlockFilePos + nSize));
+        if (AllocateFileRange(fileCurrentBlock, nCurrentBlockFileReserved, nEnd - nCurrentBlockFileReserved))
+            nCurrentBlockFileReserved = nEnd;
+        else
+        {
+            LogPrintf("AppendBlockFile() : cannot reserve space in blk%04u.dat, appending without preallocation: %s\n", nCurrentBlockFile, strerror(errno));
+            fBlockFilePreallocate = false;
+        }
+    }
+
+    if (fwrite(pch, 1, nSize, fileCurrentBlock) != nSize || fflush(fileCurrentBlock) != 0)
+    {
+        // Reopen to find out how much made it to the file
+        CloseCurrentBlockFile();
+        return error("AppendBlockFile() : write to blk%04u.dat failed", nCurrentBlockFile);
+    }
+    nFileRet = nCurrentBlockFile;
+    nPosRet = nCurrentBlockFilePos;
+    nCurrentBlockFilePos += nSize;
+    return true;
 }
-#endif
 
-bool CBlock::CheckBlockSignature() const
+void CloseBlockFileWriter()
 {
-    if (IsProofOfWork())
-        return vchBlockSig.empty();
+    LOCK(cs_BlockFileWriter);
+    CloseCurrentBlockFile();
+}
 
-    if (vchBlockSig.empty())
+// Sync the block file being appended to through its own handle, or find
+// that the writer already synced it when it moved on to the next file
+static bool SyncWrittenBlockFile(unsigned int nFile)
+{
+    LOCK(cs_BlockFileWriter);
+    if (setBlockFilesSyncedOnClose.erase(nFile))
+        return true;
+    if (!fileCurrentBlock || nFile != nCurrentBlockFile)
         return false;
+    FileCommit(fileCurrentBlock);
+    return true;
+}
 
-    vector<valtype> vSolutions;
-    txnouttype whichType;
+// Block data appended since the last commit point
+static CCriticalSection cs_BlockFileSync;
+static set<unsigned int> setUncommittedBlockFiles;
+static unsigned int nUncommittedBlocks = 0;
+static uint64_t nUncommittedBlockBytes = 0;
+static int64_t nLastCommitTime = 0;
 
-    const CTxOut& txout = vtx[1].vout[1];
+void NoteBlockWrite(unsigned int nFile, unsigned int nBytes)
+{
+    LOCK(cs_BlockFileSync);
+    setUncommittedBlockFiles.insert(nFile);
+    nUncommittedBlocks++;
+    nUncommittedBlockBytes += nBytes;
+}
 
-    if (!Solver(txout.scriptPubKey, whichType, vSolutions))
-        return false;
+// Once in sync every change is committed as it is made. While catching up,
+// commit points are spaced out by -commitblocks, -commitsize and
+// -commitinterval so one sync covers many blocks.
+bool IsCommitDue(size_t nPendingDbBytes)
+{
+    if (!IsInitialBlockDownload())
+        return true;
 
-    if (whichType == TX_PUBKEY)
+    LOCK(cs_BlockFileSync);
+    if (nLastCommitTime == 0)
+        nLastCommitTime = GetTime();
+    return nUncommittedBlocks >= nCommitBlocks ||
+           nUncommittedBlockBytes + nPendingDbBytes >= nCommitBytes ||
+           GetTime() - nLastCommitTime >= nCommitInterval;
+}
+
+bool SyncBlockFiles()
+{
+    LOCK(cs_BlockFileSync);
+    BOOST_FOREACH(unsigned int nFile, setUncommittedBlockFiles)
     {
-        valtype& vchPubKey = vSolutions[0];
-        return CPubKey(vchPubKey).Verify(GetHash(), vchBlockSig);
+        if (SyncWrittenBlockFile(nFile))
+            continue;
+        FILE* file = OpenBlockFile(nFile, 0, "ab");
+        if (!file)
+            return error("SyncBlockFiles() : cannot open blk%04u.dat", nFile);
+        FileCommit(file);
+        fclose(file);
     }
+    setUncommittedBlockFiles.clear();
+    nUncommittedBlocks = 0;
+    nUncommittedBlockBytes = 0;
+    nLastCommitTime = GetTime();
+    return true;
+}
 
-    return false;
+void GetUncommittedBlockStats(unsigned int& nBlocksRet, uint64_t& nBytesRet, int64_t& nLastCommitRet)
+{
+    LOCK(cs_BlockFileSync);
+    nBlocksRet = nUncommittedBlocks;
+    nBytesRet = nUncommittedBlockBytes;
+    nLastCommitRet = nLastCommitTime;
 }
 
-bool CheckDiskSpace(uint64_t nAdditionalBytes)
+// Block files deleted by -prune, and the highest block stored in each file
+static CCriticalSection cs_PrunedBlockFiles;
+static set<unsigned int> setPrunedBlockFiles;
+static map<unsigned int, int> mapBlockFileHeight;
+static int64_t nLastPruneCheck = 0;
+
+bool HaveBlockData(const CBlockIndex* pindex)
 {
-    uint64_t nFreeBytesAvailable = filesystem::space(GetDataDir()).available;
+    if (pindex->nFile & SNAPSHOT_BLOCK_FILE)
+        return false;
+    LOCK(cs_PrunedBlockFiles);
+    return !setPrunedBlockFiles.count(pindex->nFile);
+}
 
-    // Check for nMinDiskSpace bytes (currently 50MB)
-    if (nFreeBytesAvailable < nMinDiskSpace + nAdditionalBytes)
+// Block files missing below the highest numbered one were deleted by -prune.
+// Appending continues in the highest file rather than recreating a gap.
+// Without -prune nothing is ever deleted, so a missing file is an error.
+static bool ScanPrunedBlockFiles()
+{
+    set<unsigned int> setFiles;
+    boost::filesystem::directory_iterator end;
+    for (boost::filesystem::directory_iterator it(GetDataDir()); it != end; ++it)
     {
-        string strMessage = _("Error: Disk space is low!");
-        strMiscWarning = strMessage;
-        LogPrintf("*** %s\n", strMessage);
-        uiInterface.ThreadSafeMessageBox(strMessage, "", CClientUIInterface::MSG_ERROR);
-        StartShutdown();
-        return false;
+        unsigned int nFile;
+        string strName = it->path().filename().string();
+        if (sscanf(strName.c_str(), "blk%u.dat", &nFile) == 1 && nFile > 0 && strName == strprintf("blk%04u.dat", nFile))
+            setFiles.insert(nFile);
+    }
+
+    LOCK(cs_PrunedBlockFiles);
+    setPrunedBlockFiles.clear();
+    if (setFiles.empty())
+        return true;
+    unsigned int nLastFile = *setFiles.rbegin();
+    for (unsigned int nFile = 1; nFile < nLastFile; nFile++)
+    {
+        if (setFiles.count(nFile))
+            continue;
+        if (!fPruneMode)
+            return error("ScanPrunedBlockFiles() : blk%04u.dat is missing, restart with -prune if it was pruned", nFile);
+        setPrunedBlockFiles.insert(nFile);
     }
+    if (!fPruneMode)
+        return true;
+    nCurrentBlockFile = nLastFile;
+
+    if (!setPrunedBlockFiles.empty())
+        LogPrintf("ScanPrunedBlockFiles() : %u block files below blk%04u.dat have been pruned\n", setPrunedBlockFiles.size(), nLastFile);
     return true;
 }
 
-static filesystem::path BlockFilePath(unsigned int nFile)
+static void NoteBlockFileHeight(unsigned int nFile, int nHeight)
 {
-    string strBlockFn = strprintf("blk%04u.dat", nFile);
-    return GetDataDir() / strBlockFn;
+    if (nFile & SNAPSHOT_BLOCK_FILE)
+        return;
+    int& nHeightLast = mapBlockFileHeight.insert(make_pair(nFile, -1)).first->second;
+    nHeightLast = max(nHeightLast, nHeight);
 }
 
-FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
+// Make sure every transaction in a block file that still has unspent outputs
+// has a coins record, so validation and staking never need the file again.
+// vBlocks holds the blocks stored in the file.
+static bool SaveBlockFileCoins(CTxDB& txdb, unsigned int nFile, const vector<CBlockIndex*>& vBlocks)
 {
-    if ((nFile < 1) || (nFile == (unsigned int) -1))
-        return NULL;
-    FILE* file = fopen(BlockFilePath(nFile).string().c_str(), pszMode);
-    if (!file)
-        return NULL;
-    if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
+    BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
     {
-        if (fseek(file, nBlockPos, SEEK_SET) != 0)
+        if (!pindex->IsInMainChain())
+            continue;
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("SaveBlockFileCoins() : cannot read block %s", pindex->GetBlockHash().ToString());
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
         {
-            fclose(file);
-            return NULL;
+            uint256 hashTx = tx.GetHash();
+            CTxIndex txindex;
+            if (!txdb.ReadTxIndex(hashTx, txindex) || txindex.pos.nFile != nFile || txindex.pos.nBlockPos != pindex->nBlockPos)
+                continue;
+            bool fUnspent = false;
+            BOOST_FOREACH(const CDiskTxPos& posSpent, txindex.vSpent)
+                if (posSpent.IsNull())
+                    fUnspent = true;
+            CCoins coins;
+            if (fUnspent && !pcoinsTip->GetCoins(txdb, hashTx, txindex, coins))
+                return error("SaveBlockFileCoins() : cannot build coins of %s", hashTx.ToString());
         }
     }
-    return file;
+    return true;
 }
 
-static unsigned int nCurrentBlockFile = 1;
-
-FILE* AppendBlockFile(unsigned int& nFileRet)
+void PruneBlockFiles()
 {
-    nFileRet = 0;
-    while (true)
-    {
+    AssertLockHeld(cs_main);
+    if (!fPruneMode || !pindexBest)
+        return;
 
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-        if (!file)
+    // Summing up the file sizes is cheap but not free
+    int64_t nNow = GetTime();
+    if (nNow - nLastPruneCheck < 60)
+        return;
+    nLastPruneCheck = nNow;
+
+    int nPruneHeight = nBestHeight - MIN_BLOCKS_TO_KEEP;
+    if (nPruneHeight <= 0)
+        return;
+
+    uint64_t nTotalSize = 0;
+    vector<pair<unsigned int, uint64_t> > vCandidates;
+    for (unsigned int nFile = 1; nFile <= nCurrentBlockFile; nFile++)
+    {
         {
-            return NULL;
+            LOCK(cs_PrunedBlockFiles);
+            if (setPrunedBlockFiles.count(nFile))
+                continue;
         }
+        boost::system::error_code ec;
+        uint64_t nSize = boost::filesystem::file_size(BlockFilePath(nFile), ec);
+        if (ec)
+            continue;
+        nTotalSize += nSize;
+        map<unsigned int, int>::iterator it = mapBlockFileHeight.find(nFile);
+        int nHeightLast = (it == mapBlockFileHeight.end() ? -1 : it->second);
+        if (nFile != nCurrentBlockFile && nHeightLast < nPruneHeight)
+            vCandidates.push_back(make_pair(nFile, nSize));
+    }
+    if (nTotalSize <= nPruneTarget)
+        return;
 
-        if (fseek(file, 0, SEEK_END) != 0)
+    // Sort the blocks of every candidate file out in a single pass
+    map<unsigned int, vector<CBlockIndex*> > mapFileBlocks;
+    for (unsigned int i = 0; i < vCandidates.size(); i++)
+        mapFileBlocks[vCandidates[i].first];
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        map<unsigned int, vector<CBlockIndex*> >::iterator it = mapFileBlocks.find(item.second->nFile);
+        if (it != mapFileBlocks.end())
+            it->second.push_back(item.second);
+    }
+
+    CTxDB txdb;
+    vector<unsigned int> vPrune;
+    for (unsigned int i = 0; i < vCandidates.size() && nTotalSize > nPruneTarget; i++)
+    {
+        if (!SaveBlockFileCoins(txdb, vCandidates[i].first, mapFileBlocks[vCandidates[i].first]))
         {
-            fclose(file);   /* RGP, 4th Sep 2019, fclose added */
-            return NULL;
+            LogPrintf("PruneBlockFiles() : keeping blk%04u.dat\n", vCandidates[i].first);
+            break;
         }
+        vPrune.push_back(vCandidates[i].first);
+        nTotalSize -= vCandidates[i].second;
+    }
+    if (vPrune.empty())
+        return;
+
+    // Blocks whose data is gone can no longer be disconnected, so their undo
+    // records are of no use either
+    BOOST_FOREACH(unsigned int nFile, vPrune)
+        BOOST_FOREACH(CBlockIndex* pindex, mapFileBlocks[nFile])
+            txdb.EraseBlockUndo(pindex->GetBlockHash());
+
+    // The coins records must be committed before the data they were built from goes away
+    if (!pcoinsTip->Flush(txdb, true) || !txdb.Commit(true))
+    {
+        error("PruneBlockFiles() : failed to commit coins records");
+        return;
+    }
 
-        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
+    BOOST_FOREACH(unsigned int nFile, vPrune)
+    {
+        CloseBlockFileHandles(nFile);
         {
-            nFileRet = nCurrentBlockFile;
-            return file;
+            LOCK(cs_PrunedBlockFiles);
+            setPrunedBlockFiles.insert(nFile);
         }
-        fclose(file);
-        nCurrentBlockFile++;
-
-        MilliSleep(1); /* RGP Optimize */
+        boost::system::error_code ec;
+        boost::filesystem::remove(BlockFilePath(nFile), ec);
+        if (ec)
+            LogPrintf("PruneBlockFiles() : cannot delete blk%04u.dat: %s\n", nFile, ec.message());
+        else
+            LogPrintf("PruneBlockFiles() : deleted blk%04u.dat, last block %d\n", nFile, mapBlockFileHeight[nFile]);
     }
+    LogPrint("prune", "PruneBlockFiles() : %u MiB of block files left, target %u MiB\n", nTotalSize >> 20, nPruneTarget >> 20);
 }
 
 bool LoadBlockIndex(bool fAllowNew)
@@ -4217,10 +5516,18 @@ unsigned int nBlockPos;
     //
     // Load block index
     //
+    if (!ScanPrunedBlockFiles())
+        return false;
+    if (mapBlockIndex.empty())
+        InitBlockIndexMap();
     CTxDB txdb("cr+");
     if (!txdb.LoadBlockIndex())
         return false;
 
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        NoteBlockFileHeight(mi->second->nFile, mi->second->nHeight);
+    LogBlockIndexStats();
+
     //
     // Init with genesis block
     //
@@ -4248,7 +5555,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -4322,64 +5629,344 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn)
+// Upper bound on the deserialize and check threads used by LoadExternalBlockFile
+static const int MAX_IMPORT_WORKERS = 16;
+
+// A block handed between the stages of LoadExternalBlockFile
+struct CImportItem
 {
-    int64_t nStart = GetTimeMillis();
+    unsigned int nSeq;
+    std::vector<char> vchBlock;
+    unsigned int nRawSize; // non-zero if vchBlock is LZ4 compressed
+    CBlock block;
+    bool fValid;
+};
 
-    int nLoaded = 0;
+// Queues between the stages of LoadExternalBlockFile. The reader numbers the
+// raw blocks it finds in the file, worker threads deserialize and check them
+// in any order, and the connecting thread takes them back in file order. The
+// number of blocks in flight is bounded so a large file is never held in
+// memory at once.
+class CImportPipeline
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condRaw;
+    boost::condition_variable condChecked;
+    boost::condition_variable condSpace;
+
+    std::deque<CImportItem*> queueRaw;
+    std::map<unsigned int, CImportItem*> mapChecked;
+    unsigned int nRead;
+    unsigned int nNextSeq;
+    unsigned int nMaxPending;
+    bool fDoneReading;
+    bool fShutdown;
+
+public:
+    CImportPipeline(unsigned int nMaxPendingIn)
     {
-        try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+        nRead = 0;
+        nNextSeq = 0;
+        nMaxPending = nMaxPendingIn;
+        fDoneReading = false;
+        fShutdown = false;
+    }
+
+    ~CImportPipeline()
+    {
+        BOOST_FOREACH(CImportItem* pitem, queueRaw)
+            delete pitem;
+        BOOST_FOREACH(PAIRTYPE(const unsigned int, CImportItem*)& item, mapChecked)
+            delete item.second;
+    }
+
+    // Reader: queue a raw block, waiting while too many are in flight
+    bool PushRaw(CImportItem* pitem)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fShutdown && nRead - nNextSeq >= nMaxPending)
+            condSpace.wait(lock);
+        if (fShutdown)
+        {
+            delete pitem;
+            return false;
+        }
+        pitem->nSeq = nRead++;
+        queueRaw.push_back(pitem);
+        condRaw.notify_one();
+        return true;
+    }
+
+    void DoneReading()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fDoneReading = true;
+        condRaw.notify_all();
+        condChecked.notify_all();
+    }
+
+    // Worker: next raw block, or NULL once there are no more
+    CImportItem* PopRaw()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fShutdown && !fDoneReading && queueRaw.empty())
+            condRaw.wait(lock);
+        if (fShutdown || queueRaw.empty())
+            return NULL;
+        CImportItem* pitem = queueRaw.front();
+        queueRaw.pop_front();
+        return pitem;
+    }
+
+    void PushChecked(CImportItem* pitem)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        mapChecked.insert(make_pair(pitem->nSeq, pitem));
+        if (pitem->nSeq == nNextSeq)
+            condChecked.notify_one();
+    }
+
+    // Connecting thread: next block in file order, or NULL at the end
+    CImportItem* PopChecked()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fShutdown && !(fDoneReading && nNextSeq == nRead) && !mapChecked.count(nNextSeq))
+            condChecked.wait(lock);
+        std::map<unsigned int, CImportItem*>::iterator it = mapChecked.find(nNextSeq);
+        if (fShutdown || it == mapChecked.end())
+            return NULL;
+        CImportItem* pitem = it->second;
+        mapChecked.erase(it);
+        nNextSeq++;
+        condSpace.notify_one();
+        return pitem;
+    }
+
+    void Shutdown()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fShutdown = true;
+        condRaw.notify_all();
+        condChecked.notify_all();
+        condSpace.notify_all();
+    }
+};
+
+// Append up to nWant bytes from the file to the unread part of vBuf
+static void ReadImportChunk(FILE* fileIn, std::vector<unsigned char>& vBuf, size_t& nBufPos, size_t nWant, bool& fEof)
+{
+    vBuf.erase(vBuf.begin(), vBuf.begin() + nBufPos);
+    nBufPos = 0;
+    size_t nOld = vBuf.size();
+    vBuf.resize(nOld + nWant);
+    size_t nRead = fread(&vBuf[nOld], 1, nWant, fileIn);
+    vBuf.resize(nOld + nRead);
+    if (nRead < nWant)
+        fEof = true;
+}
+
+// Scan the file for the network magic and hand every length-prefixed block
+// that follows it to the pipeline. The file is streamed in large chunks
+// rather than re-read around every block.
+static void ThreadImportReader(FILE* fileIn, CImportPipeline* pipeline)
+{
+    static const size_t IMPORT_CHUNK_SIZE = 4 << 20;
+    static const size_t IMPORT_HEADER_SIZE = MESSAGE_START_SIZE + 4;
+    const unsigned char* pchMessageStart = Params().MessageStart();
+
+    std::vector<unsigned char> vBuf;
+    size_t nBufPos = 0;
+    bool fEof = false;
+
+    try {
+        while (true)
+        {
+            // Find the next magic in the buffered data
+            std::vector<unsigned char>::iterator itFind = std::search(vBuf.begin() + nBufPos, vBuf.end(), pchMessageStart, pchMessageStart + MESSAGE_START_SIZE);
+            if ((size_t)(vBuf.end() - itFind) < IMPORT_HEADER_SIZE)
             {
-                boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat.Get(), nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat.Get());
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
+                if (fEof)
+                    break;
+                // Keep anything that could be the start of a magic or header
+                // straddling the end of the buffer
+                nBufPos = std::min((size_t)(itFind - vBuf.begin()), vBuf.size() - std::min(vBuf.size(), IMPORT_HEADER_SIZE));
+                ReadImportChunk(fileIn, vBuf, nBufPos, IMPORT_CHUNK_SIZE, fEof);
+                continue;
+            }
+            nBufPos = itFind - vBuf.begin();
+
+            const unsigned char* pchSize = &vBuf[nBufPos + MESSAGE_START_SIZE];
+            unsigned int nSize = pchSize[0] | (pchSize[1] << 8) | (pchSize[2] << 16) | ((unsigned int)pchSize[3] << 24);
+            if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+            {
+                nBufPos++;
+                continue;
+            }
+
+            // Blocks written with -compressblocks have the flagged compressed
+            // size next, where a plain block starts with its version
+            if (vBuf.size() - nBufPos < IMPORT_HEADER_SIZE + sizeof(unsigned int))
+            {
+                if (fEof)
                     break;
-                fseek(blkdat.Get(), nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                ReadImportChunk(fileIn, vBuf, nBufPos, IMPORT_CHUNK_SIZE, fEof);
+                continue;
+            }
+            const unsigned char* pchNext = pchSize + sizeof(unsigned int);
+            unsigned int nNext = pchNext[0] | (pchNext[1] << 8) | (pchNext[2] << 16) | ((unsigned int)pchNext[3] << 24);
+            size_t nHeaderSize = IMPORT_HEADER_SIZE;
+            unsigned int nRawSize = 0;
+            if (nNext & BLOCK_LZ4_FLAG)
+            {
+                nRawSize = nSize;
+                nSize = nNext & ~BLOCK_LZ4_FLAG;
+                nHeaderSize += sizeof(unsigned int);
+                if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
-                    {
-                        nLoaded++;
-                        nPos += 4 + nSize;
-                    }
+                    nBufPos++;
+                    continue;
                 }
             }
+
+            // Buffer the whole block
+            size_t nNeed = nHeaderSize + nSize;
+            if (vBuf.size() - nBufPos < nNeed)
+            {
+                if (fEof)
+                    break;
+                ReadImportChunk(fileIn, vBuf, nBufPos, std::max(nNeed, IMPORT_CHUNK_SIZE), fEof);
+                continue;
+            }
+
+            CImportItem* pitem = new CImportItem();
+            pitem->vchBlock.assign(vBuf.begin() + nBufPos + nHeaderSize, vBuf.begin() + nBufPos + nNeed);
+            pitem->nRawSize = nRawSize;
+            nBufPos += nNeed;
+            if (!pipeline->PushRaw(pitem))
+                break;
+        }
+    }
+    catch (std::exception &e) {
+        LogPrintf("%s() : I/O error caught during load\n", __PRETTY_FUNCTION__);
+    }
+    pipeline->DoneReading();
+}
+
+// Deserialize blocks and run the checks that need no chain context, the bulk
+// of CheckBlock. The block is marked so the serial pass does not repeat them.
+static void ThreadImportWorker(CImportPipeline* pipeline)
+{
+    CImportItem* pitem;
+    while ((pitem = pipeline->PopRaw()) != NULL)
+    {
+        pitem->fValid = false;
+        try {
+            if (pitem->nRawSize)
+            {
+                std::vector<char> vchRaw(pitem->nRawSize);
+                if (!DecompressBlockData(&pitem->vchBlock[0], pitem->vchBlock.size(), &vchRaw[0], pitem->nRawSize, pitem->nRawSize))
+                    throw std::runtime_error("ThreadImportWorker() : decompression failed");
+                pitem->vchBlock.swap(vchRaw);
+            }
+            CDataStream ss(pitem->vchBlock, SER_DISK, CLIENT_VERSION);
+            ss >> pitem->block;
+            pitem->fValid = pitem->block.CheckBlockContextFree();
+            pitem->block.fChecked = pitem->fValid;
         }
         catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+            LogPrintf("%s() : Deserialize error caught during load\n", __PRETTY_FUNCTION__);
+        }
+        pitem->vchBlock.clear();
+        pipeline->PushChecked(pitem);
+    }
+}
+
+// Connect one imported block unless it is known already or its parent is not
+static bool ImportBlock(CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    if (mapBlockIndex.count(block.GetHash()) || !mapBlockIndex.count(block.hashPrevBlock))
+        return false;
+    return ProcessBlock(NULL, &block);
+}
+
+bool LoadExternalBlockFile(FILE* fileIn)
+{
+    int64_t nStart = GetTimeMillis();
+
+    // One thread connects, the others deserialize and check
+    int nWorkers = boost::thread::hardware_concurrency() - 1;
+    if (nWorkers < 1)
+        nWorkers = 1;
+    if (nWorkers > MAX_IMPORT_WORKERS)
+        nWorkers = MAX_IMPORT_WORKERS;
+
+    CImportPipeline pipeline(16 * nWorkers);
+    boost::thread_group threads;
+    threads.create_thread(boost::bind(&ThreadImportReader, fileIn, &pipeline));
+    for (int i = 0; i < nWorkers; i++)
+        threads.create_thread(boost::bind(&ThreadImportWorker, &pipeline));
+
+    int nLoaded = 0;
+    std::multimap<uint256, CImportItem*> mapUnknownParent;
+    try {
+        CImportItem* pitem;
+        while ((pitem = pipeline.PopChecked()) != NULL)
+        {
+            boost::this_thread::interruption_point();
+            if (!pitem->fValid)
+            {
+                delete pitem;
+                continue;
+            }
+
+            LOCK(cs_main);
+            uint256 hash = pitem->block.GetHash();
+            if (!mapBlockIndex.count(pitem->block.hashPrevBlock) && !mapBlockIndex.count(hash))
+            {
+                // Out of order in the file, connect it once its parent is in
+                mapUnknownParent.insert(make_pair(pitem->block.hashPrevBlock, pitem));
+                continue;
+            }
+            if (ImportBlock(pitem->block))
+                nLoaded++;
+            delete pitem;
+
+            // Connect any blocks that were waiting on this one
+            std::vector<uint256> vWorkQueue;
+            vWorkQueue.push_back(hash);
+            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+            {
+                std::multimap<uint256, CImportItem*>::iterator it;
+                while ((it = mapUnknownParent.find(vWorkQueue[i])) != mapUnknownParent.end())
+                {
+                    CImportItem* pchild = it->second;
+                    mapUnknownParent.erase(it);
+                    if (ImportBlock(pchild->block))
+                        nLoaded++;
+                    vWorkQueue.push_back(pchild->block.GetHash());
+                    delete pchild;
+                }
+            }
         }
     }
+    catch (boost::thread_interrupted) {
+        pipeline.Shutdown();
+        threads.join_all();
+        fclose(fileIn);
+        BOOST_FOREACH(PAIRTYPE(const uint256, CImportItem*)& item, mapUnknownParent)
+            delete item.second;
+        throw;
+    }
+    threads.join_all();
+    fclose(fileIn);
+
+    if (!mapUnknownParent.empty())
+        LogPrintf("LoadExternalBlockFile() : %u blocks with unknown parent were not loaded\n", mapUnknownParent.size());
+    BOOST_FOREACH(PAIRTYPE(const uint256, CImportItem*)& item, mapUnknownParent)
+        delete item.second;
+
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
 }
@@ -4572,8 +6159,6 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end())
     {
 
@@ -4593,22 +6178,44 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
 
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Send block from disk. cs_main is only needed to find it,
+                // the stored bytes go to the send queue as they are.
+                bool fFound = false;
+                unsigned int nFile = 0, nBlockPos = 0;
+                uint256 hashBest;
+                {
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end() && !HaveBlockData((*mi).second))
+                        vNotFound.push_back(inv);
+                    else if (mi != mapBlockIndex.end())
+                    {
+                        fFound = true;
+                        nFile = (*mi).second->nFile;
+                        nBlockPos = (*mi).second->nBlockPos;
+                    }
+                    hashBest = hashBestChain;
+                }
+                if (fFound)
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    pfrom->BeginMessage("block");
+                    bool fRead = ReadRawBlockFromDisk(pfrom->ssSend, nFile, nBlockPos);
+                    if (fRead)
+                        pfrom->EndMessage();
+                    else
+                    {
+                        pfrom->AbortMessage();
+                        vNotFound.push_back(inv);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    if (fRead && inv.hash == pfrom->hashContinue)
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -4616,6 +6223,7 @@ void static ProcessGetData(CNode* pfrom)
             }
             else if (inv.IsKnownType())
             {
+                LOCK(cs_main);
 
                 if(fDebug) LogPrintf("ProcessGetData -- Starting \n");
                 // Send stream from relay memory
@@ -4632,12 +6240,12 @@ void static ProcessGetData(CNode* pfrom)
                 if (!pushed && inv.type == MSG_TX)
                 {
 
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx))
+                    CTransactionRef ptx = mempool.get(inv.hash);
+                    if (ptx)
                     {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << tx;
+                        ss << *ptx;
                         pfrom->PushMessage("tx", ss);
                         pushed = true;
                     }
@@ -5320,8 +6928,8 @@ CInv Problem_Blocks_Inv;
         //if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
         //    LogPrintf("net, received getdata for: %s\n", vInv.  vInv[0].ToString());
 
+        // Answered by ProcessMessages once cs_main has been released
         pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
-        ProcessGetData(pfrom);
     }
 
 
@@ -5393,6 +7001,10 @@ CInv Problem_Blocks_Inv;
                 if ( pindex->pnext == NULL )
                     break;
 
+                // Blocks whose data we pruned cannot be served
+                if (!HaveBlockData(pindex))
+                    break;
+
                 //LogPrintf("*** RGP getblocks hash requested %s \n", pindex->GetBlockHash().ToString() );
 
                 /* RGP, new code to send more blocks to requester, if we have them stored in our blockchain file */
@@ -5456,7 +7068,7 @@ CInv Problem_Blocks_Inv;
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
             {
                 LogPrintf("*** RGP Message received getheaders Debug 004 \n");
@@ -5508,6 +7120,7 @@ CInv Problem_Blocks_Inv;
 
         if(strCommand == "tx") {
             vRecv >> tx;
+            tx.CacheHash();
             inv = CInv(MSG_TX, tx.GetHash());
             // Check for recently rejected (and do other quick existence checks)
             if (AlreadyHave(txdb, inv))
@@ -5515,6 +7128,7 @@ CInv Problem_Blocks_Inv;
         }
         else if (strCommand == "dstx") {
             vRecv >> tx >> vin >> vchSig >> sigTime;
+            tx.CacheHash();
             inv = CInv(MSG_DSTX, tx.GetHash());
             // Check for recently rejected (and do other quick existence checks)
             if (AlreadyHave(txdb, inv))
@@ -6103,6 +7717,10 @@ string strCommand;
 
         //LogPrintf("ProcessMessage, after ProcessMessage, after try catch \n");
 
+        // Serve a getdata right away, outside of ProcessMessage's cs_main
+        if (!pfrom->vRecvGetData.empty())
+            ProcessGetData(pfrom);
+
         MilliSleep( 1 );
 
 
@@ -18,6 +18,8 @@
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+
 class CValidationState;
 
 #define START_MASTERNODE_PAYMENTS_TESTNET 1513486992 //GMT: Sunday, December 17, 2017 5:03:12 AM
@@ -59,10 +61,32 @@ static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/10000;  /* RGP it was 1000 */
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 250; /* RGP it was 750 */
+/** Set in the block file number of blocks loaded from a UTXO snapshot, whose data is not stored locally */
+static const unsigned int SNAPSHOT_BLOCK_FILE = 0x80000000;
+/** Smallest -prune target in MiB */
+static const uint64_t MIN_PRUNE_TARGET_MB = 550;
+/** Number of blocks below the best block whose undo records are kept, and whose data a pruned node always keeps, so reorganizations can be undone */
+static const int MIN_BLOCKS_TO_KEEP = 500;
+/** Size a block file may grow to. It leaves room for one more block below 4 GB, where the unsigned 32-bit positions of CDiskTxPos and the block index, and FAT32, stop */
+static const unsigned int MAX_BLOCKFILE_SIZE = 0xF0000000;
+/** Defaults for -commitblocks, -commitsize (MiB) and -commitinterval (seconds), how far apart commit points are while catching up */
+static const unsigned int DEFAULT_COMMIT_BLOCKS = 500;
+static const uint64_t DEFAULT_COMMIT_SIZE = 64;
+static const int64_t DEFAULT_COMMIT_INTERVAL = 60;
+/** Disk space is reserved ahead of the block file being appended to in steps of this size */
+static const unsigned int BLOCKFILE_CHUNK_SIZE = 16 << 20;
+/** Size at which a pruned node starts a new block file, so that old data is freed in small steps */
+static const unsigned int PRUNE_BLOCKFILE_SIZE = 128 << 20;
+/** Set in the length word in front of a block stored LZ4 compressed by -compressblocks */
+static const unsigned int BLOCK_LZ4_FLAG = 0x80000000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 1000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
@@ -94,11 +118,33 @@ static bool BSC_Wallet_Synching = true;
 
 inline int64_t GetMNCollateral(int nHeight) { return MASTERNODE_COLLATERAL; }
 
+/** Hash of a block hash for the block index table. The words are mixed with a
+ *  per-process salt so that peers cannot grind blocks into one bucket.
+ */
+struct BlockHasher
+{
+    uint64_t k0, k1;
+
+    BlockHasher() : k0(0), k1(0) {}
+    BlockHasher(uint64_t k0In, uint64_t k1In) : k0(k0In), k1(k1In) {}
+
+    size_t operator()(const uint256& hash) const
+    {
+        uint64_t h = (hash.Get64(0) ^ k0) + ((hash.Get64(1) ^ k1) * 0x9e3779b97f4a7c15ULL);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return (size_t)h;
+    }
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nStakeMinConfirmations;
@@ -117,6 +163,16 @@ extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
+extern bool fAddrIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
+extern bool fPruneMode;
+extern uint64_t nPruneTarget;
+extern unsigned int nCommitBlocks;
+extern uint64_t nCommitBytes;
+extern int64_t nCommitInterval;
+extern bool fCompressBlocks;
+extern int nScriptCheckThreads;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
@@ -140,6 +196,7 @@ extern bool fLargeWorkInvalidChainFound;
 static const uint64_t nMinDiskSpace = 52428800;
 
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -166,13 +223,49 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile(unsigned int& nFileRet);
+/** Append a block record to the current block file, returning where it starts */
+bool AppendBlockFile(const char* pch, unsigned int nSize, unsigned int& nFileRet, unsigned int& nPosRet);
+/** Close the block file being appended to, releasing the space reserved past its end */
+void CloseBlockFileWriter();
+/** Close the cached read handles on a block file, or on all of them */
+void CloseBlockFileHandles(unsigned int nFile = (unsigned int)-1);
+void GetBlockFileCacheStats(uint64_t& nHitsRet, uint64_t& nMissesRet, unsigned int& nOpenRet);
+/** Append the serialized block stored at nBlockPos to s, decompressed but not deserialized */
+bool ReadRawBlockFromDisk(CDataStream& s, unsigned int nFile, unsigned int nBlockPos);
+/** Bytes of blocks written and read through -compressblocks, and the time spent in LZ4 */
+void GetBlockCompressionStats(uint64_t& nRawBytesRet, uint64_t& nStoredBytesRet, int64_t& nCompressTimeRet, uint64_t& nDecompressedBytesRet, int64_t& nDecompressTimeRet);
+/** Compress and decompress the top nBlocks blocks of the main chain in memory with LZ4, timing it against deserializing them */
+void BenchmarkBlockCompression(int nBlocks, int& nBlocksRet, uint64_t& nRawBytesRet, uint64_t& nCompressedBytesRet, int64_t& nCompressTimeRet, int64_t& nDecompressTimeRet, int64_t& nDeserializeTimeRet);
+/** Record block data appended to a block file, to be synced at the next commit point */
+void NoteBlockWrite(unsigned int nFile, unsigned int nBytes);
+/** Whether the txdb should reach a commit point, given the size of its pending changes */
+bool IsCommitDue(size_t nPendingDbBytes);
+/** Sync the block files written since the last commit point */
+bool SyncBlockFiles();
+void GetUncommittedBlockStats(unsigned int& nBlocksRet, uint64_t& nBytesRet, int64_t& nLastCommitRet);
+/** Time the reads that taking the top nBlocks of the main chain back would make: the undo records, against the index entries and transactions read without them */
+void BenchmarkDisconnectReads(int nBlocks, int& nBlocksRet, int& nUndoRet, unsigned int& nInputsRet, int64_t& nUndoTimeRet, int64_t& nReadTimeRet);
+/** Whether the data of a block is stored locally, rather than pruned or loaded from a UTXO snapshot */
+bool HaveBlockData(const CBlockIndex* pindex);
+/** Delete the oldest block files while -prune is exceeded, keeping MIN_BLOCKS_TO_KEEP blocks below the best */
+void PruneBlockFiles();
 bool LoadBlockIndex(bool fAllowNew=true);
+/** Salt mapBlockIndex afresh; only valid while it is empty */
+void InitBlockIndexMap();
+/** Storage for a new block index entry, to be constructed with placement new */
+void* AllocBlockIndex();
 void PrintBlockTree();
+/** Main chain block at a height, or NULL above the best block */
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** First main chain block with a timestamp at or after nTime, or NULL if there is none */
+CBlockIndex* FindBlockByTime(int64_t nTime);
+/** Make the chain ending in pindexNew the one FindBlockByHeight answers from */
+void SetActiveChain(CBlockIndex* pindexNew);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 
 
@@ -183,7 +276,9 @@ int64_t GetProofOfStakeReward(const CBlockIndex* pindexPrev, int64_t nCoinAge, i
 bool IsInitialBlockDownload();
 bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
 std::string GetWarnings(std::string strFor);
-bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
+/** Look up a transaction. With fAllowPruned, a transaction whose block data is gone is rebuilt
+    from its coins record: the outputs and confirming block are right but it does not hash the same. */
+bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowPruned = false);
 uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void ThreadStakeMiner(CWallet *pwallet);
@@ -197,7 +292,14 @@ bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree
                         bool* pfMissingInputs, bool fRejectInsaneFee=false, bool isDSTX=false);
 
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash);
+/** Find the transactions indexed for a destination, oldest first. nSkip entries are
+    skipped first (counted from the end when negative), then at most nCount are
+    returned (all when negative). */
+bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash, int nSkip = 0, int nCount = -1);
+/** Address type and hash a destination is kept under by -addressindex and -spentindex */
+bool GetAddressIndexKey(const CTxDestination& dest, unsigned char& addressType, uint160& addressHash);
+/** Build the -addressindex and -spentindex entries of the whole main chain from scratch */
+bool RebuildAddressIndexes();
 
 int GetInputAge(CTxIn& vin);
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin);
@@ -219,6 +321,24 @@ struct CNodeStateStats {
 };
 
 
+/** Read stream over a block file, positioned at nPos, borrowing its handle
+ *  from a small LRU cache of open block files so repeated reads skip the
+ *  fopen. The handle is the reader's own until it goes away and is then
+ *  returned to the cache, so readers of the same file do not wait on each
+ *  other.
+ */
+class CBlockFileReader : public CAutoFile
+{
+private:
+    unsigned int nFile;
+    unsigned int nEpoch;
+    FILE* fileBorrowed;
+
+public:
+    CBlockFileReader(unsigned int nFileIn, unsigned int nPos);
+    ~CBlockFileReader();
+};
+
 /** Position on disk for a particular transaction. */
 class CDiskTxPos
 {
@@ -275,12 +395,26 @@ enum GetMinFee_mode
     GMF_SEND,
 };
 
-typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
+typedef std::map<uint256, std::pair<CTxIndex, CTransactionRef> > MapPrevTx;
 
 int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree, enum GetMinFee_mode mode);
 
 
 
+/** Memory-only txid kept by a transaction that is no longer changed. A copy
+ * starts out without it, as copies get changed in place and signed again.
+ */
+class CTransactionHashMemo
+{
+public:
+    uint256 hash;
+    bool fSet;
+
+    CTransactionHashMemo() : fSet(false) {}
+    CTransactionHashMemo(const CTransactionHashMemo&) : fSet(false) {}
+    CTransactionHashMemo& operator=(const CTransactionHashMemo&) { fSet = false; return *this; }
+};
+
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
  */
@@ -294,6 +428,9 @@ public:
     std::vector<CTxOut> vout;
     unsigned int nLockTime;
 
+    // memory only: see CacheHash()
+    mutable CTransactionHashMemo hashMemo;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -311,6 +448,8 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+            const_cast<CTransaction*>(this)->hashMemo.fSet = false;
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(nTime);
@@ -327,6 +466,7 @@ public:
         vin.clear();
         vout.clear();
         nLockTime = 0;
+        hashMemo.fSet = false;
         nDoS = 0;  // Denial-of-service prevention
     }
 
@@ -338,10 +478,25 @@ public:
 
     uint256 GetHash() const
     {
-
+        if (hashMemo.fSet)
+            return hashMemo.hash;
         return SerializeHash(*this);
     }
 
+    // Answer GetHash() with hashIn from now on. Only for a transaction that
+    // will not be changed again: one just received, or shared through a
+    // CTransactionRef. Deserializing into it or copying it drops the memo.
+    void CacheHash(const uint256& hashIn) const
+    {
+        hashMemo.hash = hashIn;
+        hashMemo.fSet = true;
+    }
+
+    void CacheHash() const
+    {
+        CacheHash(SerializeHash(*this));
+    }
+
     bool IsCoinBase() const
     {
 
@@ -383,33 +538,7 @@ public:
      */
     int64_t GetValueIn(const MapPrevTx& mapInputs) const;
 
-    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
-    {
-
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
-        if (filein.IsNull())
-            return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
-
-        // Read transaction
-        if (fseek(filein.Get(), pos.nTxPos, SEEK_SET) != 0)
-            return error("CTransaction::ReadFromDisk() : fseek failed");
-
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
-
-        // Return file pointer
-        if (pfileRet)
-        {
-            if (fseek(filein.Get(), pos.nTxPos, SEEK_SET) != 0)
-                return error("CTransaction::ReadFromDisk() : second fseek failed");
-            *pfileRet = filein.release();
-        }
-        return true;
-    }
+    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL);
 
     friend bool operator==(const CTransaction& a, const CTransaction& b)
     {
@@ -465,28 +594,61 @@ public:
      @return    Returns true if all inputs are in txdb or mapTestPool
      */
     bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const;
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
 
-        @param[in] inputs   Previous transactions (from FetchInputs)
+        @param[in] inputs   Previous transactions (from FetchInputs), copied so that
+                            the index entries can be marked spent; the transactions
+                            themselves are shared
         @param[out] mapTestPool Keeps track of inputs that need to be updated on disk
         @param[in] posThisTx    Position of this transaction on disk
         @param[in] pindexBlock
         @param[in] fBlock   true if called from ConnectBlock
         @param[in] fMiner   true if called from CreateNewBlock
+        @param[out] pvChecks    If not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true,
+                       std::vector<CScriptCheck>* pvChecks = NULL) const;
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
 };
 
+/** Closure representing one script verification.
+ *  Note that this stores a reference to the spending transaction, which must
+ *  outlive the check. */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction* ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+        scriptPubKey(scriptPubKeyIn), ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) {}
+
+    bool operator()() const;
+
+    void swap(CScriptCheck& check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
 
 
 
@@ -696,6 +858,15 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: the last header hash and the 80 header bytes it was computed from
+    mutable uint256 hashCached;
+    mutable unsigned char vchHashedHeader[80];
+    mutable bool fHashCached;
+
+    // memory only: CheckBlockContextFree() already passed with every check on,
+    // set where blocks are checked ahead of connecting them
+    bool fChecked;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -707,6 +878,11 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+        {
+            const_cast<CBlock*>(this)->vMerkleTree.clear();
+            const_cast<CBlock*>(this)->fChecked = false;
+        }
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(hashPrevBlock);
@@ -739,6 +915,8 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        fHashCached = false;
+        fChecked = false;
         nDoS = 0;
     }
 
@@ -749,7 +927,15 @@ public:
 
     uint256 GetHash() const
     {
-        return Hash(BEGIN(nVersion), END(nNonce));
+        // The miner and SignBlock change the header in place, so rather than
+        // rely on every such site to reset the cache, the bytes are compared
+        if (!fHashCached || memcmp(BEGIN(nVersion), vchHashedHeader, sizeof(vchHashedHeader)) != 0)
+        {
+            memcpy(vchHashedHeader, BEGIN(nVersion), sizeof(vchHashedHeader));
+            hashCached = Hash(BEGIN(nVersion), END(nNonce));
+            fHashCached = true;
+        }
+        return hashCached;
     }
 
     uint256 GetPoWHash() const
@@ -817,6 +1003,23 @@ public:
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
     }
 
+    // Hash of vtx[nIndex], taken from the leaves of the merkle tree so that
+    // each transaction is serialized and hashed once per block. The tree is
+    // dropped by SetNull() and on deserialization, and is built here when
+    // missing; code that changes vtx must call ClearMerkleTree() or rebuild
+    // it, as it already has to for hashMerkleRoot.
+    const uint256& GetTxHash(unsigned int nIndex) const
+    {
+        if (vMerkleTree.size() < vtx.size())
+            BuildMerkleTree();
+        return vMerkleTree[nIndex];
+    }
+
+    void ClearMerkleTree() const
+    {
+        vMerkleTree.clear();
+    }
+
     std::vector<uint256> GetMerkleBranch(int nIndex) const
     {
         if (vMerkleTree.empty())
@@ -849,59 +1052,8 @@ public:
     }
 
 
-    bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
-    {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet), SER_DISK, CLIENT_VERSION);
-        if (fileout.IsNull())
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-        // Write block
-        long fileOutPos = ftell(fileout.Get());
-        if (fileOutPos < 0)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        nBlockPosRet = fileOutPos;
-        fileout << *this;
-
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout.Get());
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
-            FileCommit(fileout.Get());
-
-        return true;
-    }
-
-    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
-    {
-        SetNull();
-
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (filein.IsNull())
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
-
-        // Check the header
-        if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
-            return error("CBlock::ReadFromDisk() : errors in block header");
-
-        return true;
-    }
-
-
+    bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet);
+    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true);
 
     std::string ToString() const
     {
@@ -932,13 +1084,16 @@ public:
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof);
     bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true) const;
+    bool CheckBlockContextFree(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true) const;
     bool AcceptBlock();
     bool SignBlock(CWallet& keystore, int64_t nFees);
     bool CheckBlockSignature() const;
-    void RebuildAddressIndex(CTxDB& txdb);
+    void RebuildAddressIndex(CTxDB& txdb, int nHeight);
 
 private:
     bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
+    bool CheckBlockHeaderContextFree(bool fCheckPOW, bool fCheckSig) const;
+    bool CheckBlockTransactions(bool fCheckMerkleRoot) const;
 };
 
 
@@ -959,6 +1114,7 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip; // an ancestor further back, for GetAncestor
     unsigned int nFile;
     unsigned int nBlockPos;
     uint256 nChainTrust; // ppcoin: trust score of block chain
@@ -998,6 +1154,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
@@ -1028,6 +1185,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
@@ -1087,6 +1245,13 @@ public:
 
     uint256 GetBlockTrust() const;
 
+    // Set pskip once pprev and nHeight are known
+    void BuildSkip();
+
+    // Ancestor at a height on this block's own branch, in O(log n) steps
+    CBlockIndex* GetAncestor(int nHeightIn);
+    const CBlockIndex* GetAncestor(int nHeightIn) const;
+
     bool IsInMainChain() const
     {
         return (pnext || this == pindexBest);
@@ -1302,7 +1467,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1338,8 +1503,7 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            pindex = pindex->nHeight >= nStep ? pindex->GetAncestor(pindex->nHeight - nStep) : NULL;
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1353,7 +1517,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1372,7 +1536,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1388,7 +1552,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
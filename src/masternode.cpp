@@ -12,8 +12,6 @@
 CCriticalSection cs_masternodes;
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasternodeScanningErrors;
-// cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
 
 
 struct CompareValueOnly
@@ -25,49 +23,22 @@ struct CompareValueOnly
     }
 };
 
-//Get the last hash that matches the modulus given. Processed in reverse order
+//Get the hash of the block before nBlockHeight, or before the best block for 0
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-
-    // LogPrintf("*** RGP Masternode::GetBlockHash Start \n");
-
     if (pindexBest == NULL) return false;
 
     if(nBlockHeight == 0)
         nBlockHeight = pindexBest->nHeight;
 
-    if(mapCacheBlockHashes.count(nBlockHeight))
-    {
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
-
-    const CBlockIndex *BlockLastSolved = pindexBest;
-    const CBlockIndex *BlockReading = pindexBest;
-
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || pindexBest->nHeight+1 < nBlockHeight) return false;
-
-    int nBlocksAgo = 0;
-    if(nBlockHeight > 0) nBlocksAgo = (pindexBest->nHeight+1)-nBlockHeight;
-    assert(nBlocksAgo >= 0);
-
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if(n >= nBlocksAgo){
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-
-            return true;
-        }
-        n++;
-
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
-    }
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexBest->nHeight;
+    if (nHeight < 1) return false;
 
-    //LogPrintf("*** RGP GetBlockHash FAILED \n");
+    CBlockIndex* pindex = FindBlockByHeight(nHeight);
+    if (pindex == NULL) return false;
 
-    return false;
+    hash = pindex->GetBlockHash();
+    return true;
 }
 
 CMasternode::CMasternode()
@@ -104,13 +104,13 @@ class COrphan
 {
     public:
 
-        CTransaction* ptx;
+        const CTransaction* ptx;
         set<uint256> setDependsOn;
 
         double dPriority;
         double dFeePerKb;
 
-        COrphan(CTransaction* ptxIn)
+        COrphan(const CTransaction* ptxIn)
         {
             ptx = ptxIn;
             dPriority = dFeePerKb = 0;
@@ -124,7 +124,7 @@ int64_t nLastCoinStakeSearchInterval = 0;
 
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority; class TxPriorityCompare
+typedef boost::tuple<double, double, const CTransaction*> TxPriority; class TxPriorityCompare
 {
     bool byFee;
 
@@ -237,11 +237,11 @@ CBlock* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet *pwallet)
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        for (map<uint256, CTransactionRef>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
         {
 
             LogPrintf("*** RGP miner loop 5 \n");
-            CTransaction& tx = (*mi).second;
+            const CTransaction& tx = *(*mi).second;
             if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
             {
                 continue;
@@ -259,9 +259,9 @@ CBlock* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet *pwallet)
 
                 LogPrintf("*** RGP miner loop 6 \n");
                 // Read prev transaction
-                CTransaction txPrev;
+                CCoins coins;
                 CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                if (!GetCoins(txdb, txin.prevout.hash, coins, txindex) || txin.prevout.n >= coins.vout.size())
                 {
                     // This should never happen; all transactions in the memory
                     // pool should connect to either transactions in the chain
@@ -295,15 +295,15 @@ CBlock* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet *pwallet)
 
                     mapDependers[txin.prevout.hash].push_back(porphan);
                     porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
+                    nTotalIn += mempool.mapTx[txin.prevout.hash]->vout[txin.prevout.n].nValue;
                     
                     continue;
                 }
 
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
+                int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
                 nTotalIn += nValueIn;
 
-                int nConf = txindex.GetDepthInMainChain();
+                int nConf = 1 + nBestHeight - coins.nHeight;
                 dPriority += (double)nValueIn * nConf;
             }
 
@@ -328,7 +328,7 @@ CBlock* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet *pwallet)
             }
             else
             {
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, (*mi).second.get()));
             }
         }
 
@@ -350,7 +350,7 @@ CBlock* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet *pwallet)
             // Take highest priority transaction off the priority queue:
             double dPriority = vecPriority.front().get<0>();
             double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            const CTransaction& tx = *(vecPriority.front().get<2>());
 
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
@@ -463,6 +463,7 @@ CBlock* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet *pwallet)
         // >SOCG< POW
 
         pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(pindexPrev->nHeight + 1, nFees);
+        pblock->ClearMerkleTree();
 
 
         if (pFees)
@@ -589,11 +590,11 @@ int nHeight;
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        for (map<uint256, CTransactionRef>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
         {
 
             //LogPrintf("*** RGP miner loop 11 \n");
-            CTransaction& tx = (*mi).second;
+            const CTransaction& tx = *(*mi).second;
             if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
             {
                 continue;
@@ -610,9 +611,9 @@ int nHeight;
             {
                 //LogPrintf("*** RGP miner loop 12 \n");
                 // Read prev transaction
-                CTransaction txPrev;
+                CCoins coins;
                 CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                if (!GetCoins(txdb, txin.prevout.hash, coins, txindex) || txin.prevout.n >= coins.vout.size())
                 {
                     // This should never happen; all transactions in the memory
                     // pool should connect to either transactions in the chain
@@ -646,15 +647,15 @@ int nHeight;
 
                     mapDependers[txin.prevout.hash].push_back(porphan);
                     porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
+                    nTotalIn += mempool.mapTx[txin.prevout.hash]->vout[txin.prevout.n].nValue;
                     
                     continue;
                 }
 
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
+                int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
                 nTotalIn += nValueIn;
 
-                int nConf = txindex.GetDepthInMainChain();
+                int nConf = 1 + nBestHeight - coins.nHeight;
                 dPriority += (double)nValueIn * nConf;
             }
 
@@ -679,7 +680,7 @@ int nHeight;
             }
             else
             {
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, (*mi).second.get()));
             }
         }
 
@@ -700,7 +701,7 @@ int nHeight;
             // Take highest priority transaction off the priority queue:
             double dPriority = vecPriority.front().get<0>();
             double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            const CTransaction& tx = *(vecPriority.front().get<2>());
 
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
@@ -815,6 +816,7 @@ int nHeight;
         if (!fProofOfStake)
         {
             pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(pindexPrev->nHeight + 1, nFees);
+            pblock->ClearMerkleTree();
         }
 
         if (pFees)
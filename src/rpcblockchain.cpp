@@ -7,6 +7,8 @@
 #include "main.h"
 #include "kernel.h"
 #include "checkpoints.h"
+#include "coins.h"
+#include "txdb.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -242,6 +244,8 @@ Value getblockhash(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    if (!pblockindex)
+        throw runtime_error("Block number out of range.");
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -261,6 +265,8 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (!HaveBlockData(pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -279,13 +285,32 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    if (!pblockindex)
+        throw runtime_error("Block number out of range.");
+    if (!HaveBlockData(pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+    block.ReadFromDisk(pblockindex, true);
+
+    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+}
+
+Value getblockbytime(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "getblockbytime <timestamp> [txinfo]\n"
+            "txinfo optional to print more detailed tx info\n"
+            "Returns details of the first main chain block with a timestamp at or after the given unix time.");
 
-    uint256 hash = *pblockindex->phashBlock;
+    int64_t nTime = params[0].get_int64();
 
-    pblockindex = mapBlockIndex[hash];
+    CBlock block;
+    CBlockIndex* pblockindex = FindBlockByTime(nTime);
+    if (!pblockindex)
+        throw runtime_error("No block at or after the given time.");
+    if (!HaveBlockData(pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -310,3 +335,191 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value getcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcacheinfo\n"
+            "Returns usage and hit counters of the block file, coins and transaction caches, and\n"
+            "the bytes and time spent on blocks stored with -compressblocks.\n");
+
+    Object result;
+
+    uint64_t nHits, nMisses;
+    unsigned int nOpen;
+    GetBlockFileCacheStats(nHits, nMisses, nOpen);
+    Object blockfiles;
+    blockfiles.push_back(json_spirit::Pair("open", (int)nOpen));
+    blockfiles.push_back(json_spirit::Pair("hits", (uint64_t)nHits));
+    blockfiles.push_back(json_spirit::Pair("misses", (uint64_t)nMisses));
+    result.push_back(json_spirit::Pair("blockfiles", blockfiles));
+
+    uint64_t nRawBytes, nStoredBytes, nDecompressedBytes;
+    int64_t nCompressTime, nDecompressTime;
+    GetBlockCompressionStats(nRawBytes, nStoredBytes, nCompressTime, nDecompressedBytes, nDecompressTime);
+    Object compression;
+    compression.push_back(json_spirit::Pair("enabled", fCompressBlocks));
+    compression.push_back(json_spirit::Pair("rawbytes", (uint64_t)nRawBytes));
+    compression.push_back(json_spirit::Pair("storedbytes", (uint64_t)nStoredBytes));
+    compression.push_back(json_spirit::Pair("compressms", nCompressTime / 1000));
+    compression.push_back(json_spirit::Pair("decompressedbytes", (uint64_t)nDecompressedBytes));
+    compression.push_back(json_spirit::Pair("decompressms", nDecompressTime / 1000));
+    result.push_back(json_spirit::Pair("blockcompression", compression));
+
+    if (pcoinsTip)
+    {
+        uint64_t nDbReads, nRebuilds;
+        pcoinsTip->GetStats(nHits, nDbReads, nRebuilds);
+        Object coins;
+        coins.push_back(json_spirit::Pair("entries", (uint64_t)pcoinsTip->GetCacheSize()));
+        coins.push_back(json_spirit::Pair("usage", (uint64_t)pcoinsTip->DynamicMemoryUsage()));
+        coins.push_back(json_spirit::Pair("hits", (uint64_t)nHits));
+        coins.push_back(json_spirit::Pair("dbreads", (uint64_t)nDbReads));
+        coins.push_back(json_spirit::Pair("rebuilds", (uint64_t)nRebuilds));
+        result.push_back(json_spirit::Pair("coins", coins));
+    }
+
+    if (ptxCache)
+    {
+        ptxCache->GetStats(nHits, nMisses);
+        Object transactions;
+        transactions.push_back(json_spirit::Pair("entries", (uint64_t)ptxCache->GetCacheSize()));
+        transactions.push_back(json_spirit::Pair("usage", (uint64_t)ptxCache->DynamicMemoryUsage()));
+        transactions.push_back(json_spirit::Pair("hits", (uint64_t)nHits));
+        transactions.push_back(json_spirit::Pair("misses", (uint64_t)nMisses));
+        result.push_back(json_spirit::Pair("transactions", transactions));
+    }
+
+    return result;
+}
+
+Value benchcompression(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "benchcompression [blocks=100]\n"
+            "Compresses and decompresses the top [blocks] blocks of the main chain in memory as\n"
+            "-compressblocks would, and compares reading them with and without LZ4: the\n"
+            "throughput of deserializing the plain blocks against decompressing them first.\n"
+            "Disk reads are not timed; storedbytes against rawbytes is what LZ4 saves on them.\n");
+
+    int nBlocks = params.size() > 0 ? params[0].get_int() : 100;
+    if (nBlocks < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "blocks must be positive");
+
+    LOCK(cs_main);
+    int nBlocksRead;
+    uint64_t nRawBytes, nStoredBytes;
+    int64_t nCompressTime, nDecompressTime, nDeserializeTime;
+    BenchmarkBlockCompression(nBlocks, nBlocksRead, nRawBytes, nStoredBytes, nCompressTime, nDecompressTime, nDeserializeTime);
+
+    Object result;
+    result.push_back(json_spirit::Pair("blocks", nBlocksRead));
+    result.push_back(json_spirit::Pair("rawbytes", (uint64_t)nRawBytes));
+    result.push_back(json_spirit::Pair("storedbytes", (uint64_t)nStoredBytes));
+    result.push_back(json_spirit::Pair("compressms", nCompressTime / 1000.0));
+    result.push_back(json_spirit::Pair("decompressms", nDecompressTime / 1000.0));
+    result.push_back(json_spirit::Pair("deserializems", nDeserializeTime / 1000.0));
+    // bytes per microsecond are MB/s
+    if (nDeserializeTime > 0)
+        result.push_back(json_spirit::Pair("plainmbps", (double)nRawBytes / nDeserializeTime));
+    if (nDecompressTime + nDeserializeTime > 0)
+        result.push_back(json_spirit::Pair("lz4mbps", (double)nRawBytes / (nDecompressTime + nDeserializeTime)));
+    return result;
+}
+
+Value benchdisconnect(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "benchdisconnect [blocks=100]\n"
+            "Times the database reads that disconnecting the top [blocks] blocks of the main\n"
+            "chain would make, reading their undo records against reading back the index\n"
+            "entries of every spent transaction as blocks without undo records need.\n"
+            "Nothing is disconnected.\n");
+
+    int nBlocks = params.size() > 0 ? params[0].get_int() : 100;
+    if (nBlocks < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "blocks must be positive");
+
+    LOCK(cs_main);
+    int nBlocksRead, nUndo;
+    unsigned int nInputs;
+    int64_t nUndoTime, nReadTime;
+    BenchmarkDisconnectReads(nBlocks, nBlocksRead, nUndo, nInputs, nUndoTime, nReadTime);
+
+    Object result;
+    result.push_back(json_spirit::Pair("blocks", nBlocksRead));
+    result.push_back(json_spirit::Pair("undorecords", nUndo));
+    result.push_back(json_spirit::Pair("inputs", (uint64_t)nInputs));
+    result.push_back(json_spirit::Pair("undoms", nUndoTime / 1000.0));
+    result.push_back(json_spirit::Pair("rereadms", nReadTime / 1000.0));
+    return result;
+}
+
+Value getcommitpoint(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getcommitpoint [flush]\n"
+            "Returns the last point at which block data and the transaction index were\n"
+            "synced to disk together, and what has been written since.\n"
+            "With flush true, a new commit point is made first.\n");
+
+    CTxDB txdb("r");
+    if (params.size() > 0 && params[0].get_bool())
+    {
+        if (!txdb.Commit(true))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Commit failed");
+    }
+
+    Object result;
+    CCommitPoint commitPoint;
+    if (txdb.ReadCommitPoint(commitPoint))
+    {
+        result.push_back(json_spirit::Pair("hash", commitPoint.hashBestChain.GetHex()));
+        BlockMap::iterator mi = mapBlockIndex.find(commitPoint.hashBestChain);
+        if (mi != mapBlockIndex.end())
+            result.push_back(json_spirit::Pair("height", (*mi).second->nHeight));
+        result.push_back(json_spirit::Pair("time", commitPoint.nTime));
+    }
+
+    unsigned int nBlocks;
+    uint64_t nBlockBytes;
+    int64_t nLastSync;
+    GetUncommittedBlockStats(nBlocks, nBlockBytes, nLastSync);
+    size_t nWrites, nDbBytes;
+    CTxDB::GetPendingStats(nWrites, nDbBytes);
+    result.push_back(json_spirit::Pair("pendingblocks", (int)nBlocks));
+    result.push_back(json_spirit::Pair("pendingblockbytes", (uint64_t)nBlockBytes));
+    result.push_back(json_spirit::Pair("pendingwrites", (uint64_t)nWrites));
+    result.push_back(json_spirit::Pair("pendingwritebytes", (uint64_t)nDbBytes));
+    return result;
+}
+
+Value dumpsnapshot(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumpsnapshot <filename>\n"
+            "Writes the unspent output state at the current best block and the block index\n"
+            "of the main chain to <filename>, for use with -loadsnapshot.\n");
+
+    string strFile = params[0].get_str();
+    CTxDB txdb("r+");
+    CSnapshotHeader header;
+    uint64_t nCoins;
+    uint256 hashChecksum;
+    string strError;
+    if (!txdb.DumpSnapshot(strFile, header, nCoins, hashChecksum, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, "Snapshot failed: " + strError);
+
+    Object result;
+    result.push_back(json_spirit::Pair("file", strFile));
+    result.push_back(json_spirit::Pair("hash", header.hashBlock.GetHex()));
+    result.push_back(json_spirit::Pair("height", header.nHeight));
+    result.push_back(json_spirit::Pair("transactions", (uint64_t)nCoins));
+    result.push_back(json_spirit::Pair("checksum", hashChecksum.GetHex()));
+    return result;
+}
@@ -121,6 +121,11 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getblock", 1 },
     { "getblockbynumber", 0 },
     { "getblockbynumber", 1 },
+    { "getblockbytime", 0 },
+    { "getblockbytime", 1 },
+    { "getcommitpoint", 0 },
+    { "benchdisconnect", 0 },
+    { "benchcompression", 0 },
     { "getblockhash", 0 },
     { "move", 2 },
     { "move", 3 },
@@ -168,6 +173,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "searchrawtransactions", 1 },
     { "searchrawtransactions", 2 },
     { "searchrawtransactions", 3 },
+    { "getspentinfo", 1 },
     { "firewallenabled", 1 },
     { "firewallstatus", 0 },
     { "firewallclearblacklist", 1 },
@@ -296,8 +296,11 @@ Value importwallet(const Array& params, bool fHelp)
     file.close();
     pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
 
-    CBlockIndex *pindex = pindexBest;
-    while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
+    // Rescan from just before the first block newer than the earliest key
+    CBlockIndex *pindex = FindBlockByTime(nTimeBegin - 7200 + 1);
+    if (!pindex)
+        pindex = pindexBest;
+    else if (pindex->pprev)
         pindex = pindex->pprev;
 
     if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
@@ -390,6 +390,7 @@ Value checkkernel(const Array& params, bool fHelp)
     unique_ptr<CBlock> pblock(CreateNewBlock(*pMiningKey, true, &nFees));
 
     pblock->nTime = pblock->vtx[0].nTime = nTime;
+    pblock->ClearMerkleTree();
 
     CDataStream ss(SER_DISK, PROTOCOL_VERSION);
     ss << *pblock;
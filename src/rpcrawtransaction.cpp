@@ -91,7 +91,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(json_spirit::Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
@@ -408,8 +408,8 @@ Value signrawtransaction(const Array& params, bool fHelp)
         BOOST_FOREACH(const CTxIn& txin, tempTx.vin)
         {
             const uint256& prevHash = txin.prevout.hash;
-            if (mapPrevTx.count(prevHash) && mapPrevTx[prevHash].second.vout.size()>txin.prevout.n)
-                mapPrevOut[txin.prevout] = mapPrevTx[prevHash].second.vout[txin.prevout.n].scriptPubKey;
+            if (mapPrevTx.count(prevHash) && mapPrevTx[prevHash].second->vout.size()>txin.prevout.n)
+                mapPrevOut[txin.prevout] = mapPrevTx[prevHash].second->vout[txin.prevout.n].scriptPubKey;
         }
     }
 
@@ -612,10 +612,6 @@ Value searchrawtransactions(const Array &params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
     CTxDestination dest = address.Get();
 
-    std::vector<uint256> vtxhash;
-    if (!FindTransactionsByDestination(dest, vtxhash))
-        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
-
     int nSkip = 0;
     int nCount = 100;
     bool fVerbose = true;
@@ -626,18 +622,18 @@ Value searchrawtransactions(const Array &params, bool fHelp)
     if (params.size() > 3)
         nCount = params[3].get_int();
 
-    if (nSkip < 0)
-        nSkip += vtxhash.size();
-    if (nSkip < 0)
-        nSkip = 0;
     if (nCount < 0)
         nCount = 0;
 
+    // Only the requested page is read from the address index
+    std::vector<uint256> vtxhash;
+    if (!FindTransactionsByDestination(dest, vtxhash, nSkip, nCount))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+
     std::vector<uint256>::const_iterator it = vtxhash.begin();
-    while (it != vtxhash.end() && nSkip--) it++;
 
     Array result;
-    while (it != vtxhash.end() && nCount--) {
+    while (it != vtxhash.end()) {
         CTransaction tx;
         uint256 hashBlock;
         if (!GetTransaction(*it, tx, hashBlock))
@@ -667,3 +663,126 @@ Value searchrawtransactions(const Array &params, bool fHelp)
     }
     return result;
 }
+
+// Address index keys of an address, or of each address in an array of them
+static void ParseAddressIndexKeys(const Value& param, vector<pair<unsigned char, uint160> >& vKeys)
+{
+    Array addresses;
+    if (param.type() == array_type)
+        addresses = param.get_array();
+    else
+        addresses.push_back(param);
+
+    BOOST_FOREACH(const Value& value, addresses)
+    {
+        CSocietyGcoinAddress address(value.get_str());
+        unsigned char addressType;
+        uint160 addressHash;
+        if (!address.IsValid() || !GetAddressIndexKey(address.Get(), addressType, addressHash))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address: " + value.get_str());
+        vKeys.push_back(make_pair(addressType, addressHash));
+    }
+}
+
+static string AddressFromIndexKey(unsigned char addressType, const uint160& addressHash)
+{
+    if (addressType == ADDRESSINDEX_SCRIPTHASH)
+        return CSocietyGcoinAddress(CScriptID(addressHash)).ToString();
+    return CSocietyGcoinAddress(CKeyID(addressHash)).ToString();
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <address|[\"address\",...]>\n"
+            "Returns the balance of the given addresses and the total they ever received.\n"
+            "Requires -addressindex.");
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, start with -addressindex");
+
+    vector<pair<unsigned char, uint160> > vKeys;
+    ParseAddressIndexKeys(params[0], vKeys);
+
+    CTxDB txdb("r");
+    int64_t nBalance = 0, nReceived = 0;
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        int64_t nAddressBalance, nAddressReceived;
+        if (!txdb.ReadAddressBalance(vKeys[i].first, vKeys[i].second, nAddressBalance, nAddressReceived))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot read the address index");
+        nBalance += nAddressBalance;
+        nReceived += nAddressReceived;
+    }
+
+    Object result;
+    result.push_back(json_spirit::Pair("balance", ValueFromAmount(nBalance)));
+    result.push_back(json_spirit::Pair("received", ValueFromAmount(nReceived)));
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos <address|[\"address\",...]>\n"
+            "Returns the unspent outputs of the given addresses in the main chain.\n"
+            "Requires -addressindex.");
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, start with -addressindex");
+
+    vector<pair<unsigned char, uint160> > vKeys;
+    ParseAddressIndexKeys(params[0], vKeys);
+
+    CTxDB txdb("r");
+    Array result;
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        if (!txdb.ReadAddressUnspent(vKeys[i].first, vKeys[i].second, vUnspent))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot read the address index");
+
+        string strAddress = AddressFromIndexKey(vKeys[i].first, vKeys[i].second);
+        for (unsigned int j = 0; j < vUnspent.size(); j++)
+        {
+            const CAddressUnspentKey& key = vUnspent[j].first;
+            const CAddressUnspentValue& value = vUnspent[j].second;
+            Object entry;
+            entry.push_back(json_spirit::Pair("address", strAddress));
+            entry.push_back(json_spirit::Pair("txid", key.txHash.GetHex()));
+            entry.push_back(json_spirit::Pair("outputIndex", (int)key.nOut));
+            entry.push_back(json_spirit::Pair("script", HexStr(value.scriptPubKey.begin(), value.scriptPubKey.end())));
+            entry.push_back(json_spirit::Pair("amount", ValueFromAmount(value.nValue)));
+            entry.push_back(json_spirit::Pair("height", value.nHeight));
+            result.push_back(entry);
+        }
+    }
+    return result;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo <txid> <index>\n"
+            "Returns the transaction and input that spent the given output, and the height of its block.\n"
+            "Requires -spentindex.");
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled, start with -spentindex");
+
+    COutPoint outpoint(ParseHashV(params[0], "txid"), params[1].get_int());
+
+    CTxDB txdb("r");
+    CSpentIndexValue value;
+    if (!txdb.ReadSpentIndex(outpoint, value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    Object result;
+    result.push_back(json_spirit::Pair("txid", value.txHash.GetHex()));
+    result.push_back(json_spirit::Pair("index", (int)value.nIn));
+    result.push_back(json_spirit::Pair("height", value.nHeight));
+    return result;
+}
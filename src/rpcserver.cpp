@@ -384,6 +384,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getrawmempool",          &getrawmempool,          true,      false,     false },
     { "getblock",               &getblock,               false,     false,     false },
     { "getblockbynumber",       &getblockbynumber,       false,     false,     false },
+    { "getblockbytime",         &getblockbytime,         false,     false,     false },
     { "getblockhash",           &getblockhash,           false,     false,     false },
     { "getrawtransaction",      &getrawtransaction,      false,     false,     false },
     { "createrawtransaction",   &createrawtransaction,   false,     false,     false },
@@ -392,11 +393,19 @@ static const CRPCCommand vRPCCommands[] =
     { "signrawtransaction",     &signrawtransaction,     false,     false,     false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,     false },
     { "getcheckpoint",          &getcheckpoint,          true,      false,     false },
+    { "getcacheinfo",           &getcacheinfo,           true,      false,     false },
+    { "getcommitpoint",         &getcommitpoint,         true,      false,     false },
+    { "benchdisconnect",        &benchdisconnect,        true,      false,     false },
+    { "benchcompression",       &benchcompression,       true,      false,     false },
+    { "dumpsnapshot",           &dumpsnapshot,           false,     false,     false },
     { "sendalert",              &sendalert,              false,     false,     false },
     { "validateaddress",        &validateaddress,        true,      false,     false },
     { "validatepubkey",         &validatepubkey,         true,      false,     false },
     { "verifymessage",          &verifymessage,          false,     false,     false },
     { "searchrawtransactions",  &searchrawtransactions,  false,     false,     false },
+    { "getaddressbalance",      &getaddressbalance,      false,     false,     false },
+    { "getaddressutxos",        &getaddressutxos,        false,     false,     false },
+    { "getspentinfo",           &getspentinfo,           false,     false,     false },
 
     /* ---------------------
        -- RGP JIRA BSG-51 --
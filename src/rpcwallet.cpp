@@ -1826,7 +1826,7 @@ Value gettransaction(const Array& params, bool fHelp)
             else
             {
                 entry.push_back(json_spirit::Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -2503,12 +2503,7 @@ Value scanforalltxns(const Array& params, bool fHelp)
 
 
     if (nFromHeight > 0)
-    {
-        pindex = mapBlockIndex[hashBestChain];
-        while (pindex->nHeight > nFromHeight
-            && pindex->pprev)
-            pindex = pindex->pprev;
-    };
+        pindex = FindBlockByHeight(std::min(nFromHeight, nBestHeight));
 
     if (pindex == NULL)
         throw runtime_error("Genesis Block is not set.");
@@ -2547,12 +2542,7 @@ Value scanforstealthtxns(const Array& params, bool fHelp)
 
 
     if (nFromHeight > 0)
-    {
-        pindex = mapBlockIndex[hashBestChain];
-        while (pindex->nHeight > nFromHeight
-            && pindex->pprev)
-            pindex = pindex->pprev;
-    };
+        pindex = FindBlockByHeight(std::min(nFromHeight, nBestHeight));
 
     if (pindex == NULL)
         throw runtime_error("Genesis Block is not set.");
@@ -8,8 +8,8 @@
    -------------------------------------------- */
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_set.hpp>
 
 using namespace std;
 using namespace boost;
@@ -2035,64 +2035,125 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+namespace {
+
+/** Wrapper that serializes like CTransaction, but with the modifications
+ *  required for the signature hash done in-place, so that no copy of the
+ *  transaction is made for every input being signed or verified */
+class CTransactionSignatureSerializer
 {
-    if (nIn >= txTo.vin.size())
+private:
+    const CTransaction& txTo;  // reference to the spending transaction (the one being serialized)
+    const CScript& scriptCode; // output script being consumed
+    const unsigned int nIn;    // input index of txTo being signed
+    const bool fAnyoneCanPay;  // whether the hashtype has the SIGHASH_ANYONECANPAY flag set
+    const bool fHashSingle;    // whether the hashtype is SIGHASH_SINGLE
+    const bool fHashNone;      // whether the hashtype is SIGHASH_NONE
+
+public:
+    CTransactionSignatureSerializer(const CTransaction& txToIn, const CScript& scriptCodeIn, unsigned int nInIn, int nHashTypeIn) :
+        txTo(txToIn), scriptCode(scriptCodeIn), nIn(nInIn),
+        fAnyoneCanPay(!!(nHashTypeIn & SIGHASH_ANYONECANPAY)),
+        fHashSingle((nHashTypeIn & 0x1f) == SIGHASH_SINGLE),
+        fHashNone((nHashTypeIn & 0x1f) == SIGHASH_NONE) {}
+
+    /** Serialize the passed scriptCode, skipping OP_CODESEPARATORs the way
+     *  CScript::FindAndDelete would remove them */
+    template<typename S>
+    void SerializeScriptCode(S& s, int nType, int nVersion) const
     {
-        LogPrintf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
-        return 1;
+        CScript::const_iterator it = scriptCode.begin();
+        CScript::const_iterator itBegin = it;
+        opcodetype opcode;
+        unsigned int nCodeSeparators = 0;
+        while (scriptCode.GetOp(it, opcode))
+        {
+            if (opcode == OP_CODESEPARATOR)
+                nCodeSeparators++;
+        }
+        ::WriteCompactSize(s, scriptCode.size() - nCodeSeparators);
+        it = itBegin;
+        while (scriptCode.GetOp(it, opcode))
+        {
+            if (opcode == OP_CODESEPARATOR)
+            {
+                s.write((char*)&itBegin[0], it - itBegin - 1);
+                itBegin = it;
+            }
+        }
+        // anything after an unparsable opcode is kept as is
+        if (itBegin != scriptCode.end())
+            s.write((char*)&itBegin[0], scriptCode.end() - itBegin);
     }
-    CTransaction txTmp(txTo);
-
-    // In case concatenating two scripts ends up with two codeseparators,
-    // or an extra one at the end, this prevents all those possible incompatibilities.
-    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
-
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    /** Serialize an input of txTo */
+    template<typename S>
+    void SerializeInput(S& s, unsigned int nInput, int nType, int nVersion) const
     {
-        // Wildcard payee
-        txTmp.vout.clear();
+        // In case of SIGHASH_ANYONECANPAY, only the input being signed is serialized
+        if (fAnyoneCanPay)
+            nInput = nIn;
+        ::Serialize(s, txTo.vin[nInput].prevout, nType, nVersion);
+        if (nInput != nIn)
+            // Blank out other inputs' signatures
+            ::Serialize(s, CScript(), nType, nVersion);
+        else
+            SerializeScriptCode(s, nType, nVersion);
+        if (nInput != nIn && (fHashSingle || fHashNone))
+            // Let the others update at will
+            ::Serialize(s, (unsigned int)0, nType, nVersion);
+        else
+            ::Serialize(s, txTo.vin[nInput].nSequence, nType, nVersion);
+    }
 
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+    /** Serialize an output of txTo */
+    template<typename S>
+    void SerializeOutput(S& s, unsigned int nOutput, int nType, int nVersion) const
+    {
+        if (fHashSingle && nOutput != nIn)
+            // Only lock-in the txout payee at same index as txin
+            ::Serialize(s, CTxOut(), nType, nVersion);
+        else
+            ::Serialize(s, txTo.vout[nOutput], nType, nVersion);
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+
+    /** Serialize txTo, field by field as CTransaction does */
+    template<typename S>
+    void Serialize(S& s, int nType, int nVersion) const
     {
-        // Only lock-in the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
-        {
-            LogPrintf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return 1;
-        }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
+        ::Serialize(s, txTo.nVersion, nType, nVersion);
+        ::Serialize(s, txTo.nTime, nType, nVersion);
+        unsigned int nInputs = fAnyoneCanPay ? 1 : txTo.vin.size();
+        ::WriteCompactSize(s, nInputs);
+        for (unsigned int nInput = 0; nInput < nInputs; nInput++)
+            SerializeInput(s, nInput, nType, nVersion);
+        unsigned int nOutputs = fHashNone ? 0 : (fHashSingle ? nIn + 1 : txTo.vout.size());
+        ::WriteCompactSize(s, nOutputs);
+        for (unsigned int nOutput = 0; nOutput < nOutputs; nOutput++)
+            SerializeOutput(s, nOutput, nType, nVersion);
+        ::Serialize(s, txTo.nLockTime, nType, nVersion);
+    }
+};
+
+} // anon namespace
 
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (nIn >= txTo.vin.size())
+    {
+        LogPrintf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
     }
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
+    if ((nHashType & 0x1f) == SIGHASH_SINGLE && nIn >= txTo.vout.size())
     {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+        LogPrintf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
     }
 
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
-    ss << txTmp << nHashType;
+    ss << CTransactionSignatureSerializer(txTo, scriptCode, nIn, nHashType) << nHashType;
     return ss.GetHash();
 }
 
@@ -2148,56 +2209,87 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are the salted SHA256 of (signature hash, public key, signature),
+// so they are a fixed 32 bytes and peers cannot choose which bucket or shard
+// a signature lands in. Each shard has its own lock, so the -par script check
+// threads rarely wait on one another.
+
+struct CSignatureCacheHasher
+{
+    // the entries are already salted hashes
+    size_t operator()(const uint256& entry) const { return entry.Get64(0); }
+};
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const unsigned int SHARDS = 16;
+    typedef boost::unordered_set<uint256, CSignatureCacheHasher> map_type;
+
+    struct CShard
+    {
+        map_type setValid;
+        boost::shared_mutex cs_sigcache;
+    };
+
+    CShard shards[SHARDS];
+    uint256 nonce;
+    size_t nMaxShardEntries;
+
+    CShard& GetShard(const uint256& entry) { return shards[entry.Get64(1) % SHARDS]; }
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache()
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        GetRandBytes(nonce.begin(), 32);
+        // key, node and bucket pointers per entry
+        int64_t nMaxCacheSize = std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE)) << 20;
+        nMaxShardEntries = nMaxCacheSize / (sizeof(uint256) + 3 * sizeof(void*)) / SHARDS;
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    void ComputeEntry(uint256& entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    {
+        CSHA256 hasher;
+        hasher.Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(pubKey.begin(), pubKey.size());
+        if (!vchSig.empty())
+            hasher.Write(&vchSig[0], vchSig.size());
+        hasher.Finalize(entry.begin());
+    }
+
+    bool Get(const uint256& entry, bool fErase)
+    {
+        CShard& shard = GetShard(entry);
+        if (fErase)
+        {
+            boost::unique_lock<boost::shared_mutex> lock(shard.cs_sigcache);
+            return shard.setValid.erase(entry) > 0;
+        }
+        boost::shared_lock<boost::shared_mutex> lock(shard.cs_sigcache);
+        return shard.setValid.count(entry) > 0;
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    void Set(const uint256& entry)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (nMaxShardEntries == 0)
+            return;
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        CShard& shard = GetShard(entry);
+        boost::unique_lock<boost::shared_mutex> lock(shard.cs_sigcache);
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        while (shard.setValid.size() >= nMaxShardEntries)
         {
-            // Evict a random entry. Random because that helps
+            // Evict from a random bucket. Random because that helps
             // foil would-be DoS attackers who might try to pre-generate
             // and re-use a set of valid signatures just-slightly-greater
             // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            map_type::size_type nBucket = GetRand(shard.setValid.bucket_count());
+            map_type::local_iterator it = shard.setValid.begin(nBucket);
+            if (it != shard.setValid.end(nBucket))
+                shard.setValid.erase(*it);
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        shard.setValid.insert(entry);
     }
 };
 
@@ -2221,14 +2313,18 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
 
     uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    // Callers that do not cache, like ConnectBlock, will not see this
+    // signature again, so a hit also frees its entry for the memory pool
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
+    if (signatureCache.Get(entry, flags & SCRIPT_VERIFY_NOCACHE))
         return true;
 
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
 
     return true;
 }
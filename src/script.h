@@ -93,6 +93,9 @@ enum
     SIGHASH_ANYONECANPAY = 0x80,
 };
 
+/** Default for -maxsigcachesize, the signature cache size in megabytes */
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+
 /** Script verification flags */
 enum
 {
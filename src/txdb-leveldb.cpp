@@ -8,12 +8,16 @@
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
 #include <leveldb/filter_policy.h>
 #include <memenv/memenv.h>
 
+#include "coins.h"
+#include "hash.h"
 #include "kernel.h"
 #include "checkpoints.h"
 #include "txdb.h"
@@ -26,11 +30,19 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+CCriticalSection CTxDB::cs_pending;
+CTxDB::BatchOverlay CTxDB::pendingOverlay;
+size_t CTxDB::nPendingBytes = 0;
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 10);
     options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    // While catching up a commit point writes the changes of many blocks at
+    // once, so give the memtable room for a good part of one instead of
+    // flushing a stream of small level-0 files
+    options.write_buffer_size = std::max((size_t)4 << 20, ((size_t)GetArg("-commitsize", 64) << 20) / 4);
     return options;
 }
 
@@ -69,7 +81,8 @@ void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
 CTxDB::CTxDB(const char* pszMode)
 {
     assert(pszMode);
-    activeBatch = NULL;
+    activeOverlay = NULL;
+    fBenchOverlay = false;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
 
     if (txdb) {
@@ -98,8 +111,8 @@ CTxDB::CTxDB(const char* pszMode)
             // Leveldb instance destruction
             delete txdb;
             txdb = pdb = NULL;
-            delete activeBatch;
-            activeBatch = NULL;
+            delete activeOverlay;
+            activeOverlay = NULL;
 
             init_blockindex(options, true); // Remove directory and create new database
             pdb = txdb;
@@ -129,99 +142,1007 @@ void CTxDB::Close()
     options.filter_policy = NULL;
     delete options.block_cache;
     options.block_cache = NULL;
-    delete activeBatch;
-    activeBatch = NULL;
+    delete activeOverlay;
+    activeOverlay = NULL;
 }
 
 bool CTxDB::TxnBegin()
 {
-    assert(!activeBatch);
-    activeBatch = new leveldb::WriteBatch();
+    assert(!activeOverlay);
+    activeOverlay = new BatchOverlay();
+    fBenchOverlay = LogAcceptCategory("bench");
+    nOverlayLookups = 0;
+    nOverlayLookupTime = 0;
+    nOverlayReplayEntries = 0;
     return true;
 }
 
 bool CTxDB::TxnCommit()
 {
-    assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
-    delete activeBatch;
-    activeBatch = NULL;
+    assert(activeOverlay);
+    // Replaying the write batch, as reads did before the overlay, walked
+    // every queued write for each lookup
+    if (fBenchOverlay && nOverlayLookups > 0)
+        LogPrint("bench", "CTxDB::TxnCommit() : %u writes, %u overlay lookups in %.2fms, a batch replay would have walked %u entries\n",
+                 activeOverlay->size(), nOverlayLookups, nOverlayLookupTime * 0.001, nOverlayReplayEntries);
+    {
+        LOCK(cs_pending);
+        for (BatchOverlay::iterator it = activeOverlay->begin(); it != activeOverlay->end(); ++it)
+            QueuePending(it->first, it->second);
+    }
+    delete activeOverlay;
+    activeOverlay = NULL;
+    return Commit();
+}
+
+// Takes over the value of entry rather than copying it
+void CTxDB::QueuePending(const string &strKey, CBatchEntry &entry)
+{
+    AssertLockHeld(cs_pending);
+    BatchOverlay::iterator it = pendingOverlay.find(strKey);
+    if (it == pendingOverlay.end())
+    {
+        it = pendingOverlay.insert(make_pair(strKey, CBatchEntry())).first;
+        nPendingBytes += strKey.size();
+    }
+    else
+        nPendingBytes -= it->second.strValue.size();
+    it->second.fDeleted = entry.fDeleted;
+    it->second.strValue.swap(entry.strValue);
+    nPendingBytes += it->second.strValue.size();
+}
+
+// A commit point is reached once enough blocks, bytes or time have gone by
+// since the last one (see IsCommitDue). The block files are synced first and
+// the pending changes then go to LevelDB in a single synced write together
+// with the new commit point, so after a crash the database is exactly as of
+// the last commit point and only refers to block data that is on disk.
+// Blocks appended after it are left unreferenced in the block files and are
+// downloaded again.
+bool CTxDB::Commit(bool fForce)
+{
+    LOCK(cs_pending);
+    if (!fForce && !IsCommitDue(nPendingBytes))
+        return true;
+
+    unsigned int nBlocks;
+    uint64_t nBlockBytes;
+    int64_t nLastCommit;
+    GetUncommittedBlockStats(nBlocks, nBlockBytes, nLastCommit);
+
+    // Block data first, so nothing committed below can refer past it
+    if (!SyncBlockFiles())
+        return error("CTxDB::Commit() : SyncBlockFiles failed");
+    if (pendingOverlay.empty())
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    CCommitPoint commitPoint;
+    ReadHashBestChain(commitPoint.hashBestChain);
+    commitPoint.nTime = GetTime();
+
+    leveldb::WriteBatch batch;
+    for (BatchOverlay::const_iterator it = pendingOverlay.begin(); it != pendingOverlay.end(); ++it)
+    {
+        if (it->second.fDeleted)
+            batch.Delete(it->first);
+        else
+            batch.Put(it->first, it->second.strValue);
+    }
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string("commitPoint");
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << commitPoint;
+    batch.Put(ssKey.str(), ssValue.str());
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status status = pdb->Write(writeOptions, &batch);
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
     }
+
+    LogPrint("txdb", "CTxDB::Commit() : wrote %u changes (%u bytes) for %u blocks in %dms\n", pendingOverlay.size(), nPendingBytes, nBlocks, GetTimeMillis() - nStart);
+    pendingOverlay.clear();
+    nPendingBytes = 0;
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
+bool CTxDB::ReadCommitPoint(CCommitPoint& commitPoint)
+{
+    return Read(string("commitPoint"), commitPoint);
+}
 
-    CBatchScanner() : foundEntry(false) {}
+void CTxDB::GetPendingStats(size_t& nWrites, size_t& nBytes)
+{
+    LOCK(cs_pending);
+    nWrites = pendingOverlay.size();
+    nBytes = nPendingBytes;
+}
 
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
+bool CTxDB::DirectPut(const string &strKey, const string &strValue)
+{
+    LOCK(cs_pending);
+    if (!pendingOverlay.empty())
+    {
+        CBatchEntry entry;
+        entry.fDeleted = false;
+        entry.strValue = strValue;
+        QueuePending(strKey, entry);
+        return true;
+    }
+    leveldb::Status status = pdb->Put(leveldb::WriteOptions(), strKey, strValue);
+    if (!status.ok()) {
+        LogPrintf("LevelDB write failure: %s\n", status.ToString());
+        return false;
+    }
+    return true;
+}
+
+bool CTxDB::DirectDelete(const string &strKey)
+{
+    LOCK(cs_pending);
+    if (!pendingOverlay.empty())
+    {
+        CBatchEntry entry;
+        entry.fDeleted = true;
+        QueuePending(strKey, entry);
+        return true;
     }
+    leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), strKey);
+    return (status.ok() || status.IsNotFound());
+}
+
+void CTxDB::BatchPut(const string &strKey, const string &strValue)
+{
+    CBatchEntry &entry = (*activeOverlay)[strKey];
+    entry.fDeleted = false;
+    entry.strValue = strValue;
+}
+
+void CTxDB::BatchDelete(const string &strKey)
+{
+    CBatchEntry &entry = (*activeOverlay)[strKey];
+    entry.fDeleted = true;
+    entry.strValue.clear();
+}
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
+// When performing a read, if we have an open transaction we need to check it
+// first before reading from the database, as the rest of the code assumes that
+// once a database transaction begins reads are consistent with it. The overlay
+// holds the latest operation for every key written in the transaction, so this
+// is a single hash lookup regardless of how many writes have been queued.
+bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
+    assert(activeOverlay);
+    int64_t nStart = fBenchOverlay ? GetTimeMicros() : 0;
+    *deleted = false;
+    BatchOverlay::const_iterator it = activeOverlay->find(key.str());
+    bool fFound = (it != activeOverlay->end());
+    if (fFound)
+    {
+        if (it->second.fDeleted)
             *deleted = true;
+        else
+            *value = it->second.strValue;
+    }
+    if (fBenchOverlay)
+    {
+        nOverlayLookups++;
+        nOverlayLookupTime += GetTimeMicros() - nStart;
+        nOverlayReplayEntries += activeOverlay->size();
+    }
+    return fFound;
+}
+
+bool CTxDB::ScanPending(const CDataStream &key, string *value, bool *deleted) {
+    LOCK(cs_pending);
+    *deleted = false;
+    BatchOverlay::const_iterator it = pendingOverlay.find(key.str());
+    if (it == pendingOverlay.end())
+        return false;
+    if (it->second.fDeleted)
+        *deleted = true;
+    else
+        *value = it->second.strValue;
+    return true;
+}
+
+bool CTxDB::WriteAddrIndex(uint160 addrHash, int nHeight, uint256 txHash)
+{
+    return Write(make_pair(string("adx"), CAddrIndexKey(addrHash, nHeight, txHash)), string());
+}
+
+bool CTxDB::EraseAddrIndex(uint160 addrHash, int nHeight, uint256 txHash)
+{
+    return Erase(make_pair(string("adx"), CAddrIndexKey(addrHash, nHeight, txHash)));
+}
+
+bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes, unsigned int nSkip, unsigned int nCount)
+{
+    txHashes.clear();
+    CAddrIndexCursor cursor(*this, addrHash);
+    if (!cursor.Valid())
+        return false;
+    cursor.Skip(nSkip);
+    for (; cursor.Valid() && txHashes.size() < nCount; cursor.Next())
+        txHashes.push_back(cursor.GetKey().txHash);
+    return true;
+}
+
+bool CTxDB::ReadAddrIndexLast(uint160 addrHash, std::vector<uint256>& txHashes, unsigned int nLast, unsigned int nCount)
+{
+    txHashes.clear();
+    CAddrIndexCursor cursor(*this, addrHash, true);
+    if (!cursor.Valid())
+        return false;
+    for (; cursor.Valid() && txHashes.size() < nLast; cursor.Next())
+        txHashes.push_back(cursor.GetKey().txHash);
+    reverse(txHashes.begin(), txHashes.end());
+    if (txHashes.size() > nCount)
+        txHashes.resize(nCount);
+    return true;
+}
+
+unsigned int CTxDB::CountAddrIndex(uint160 addrHash)
+{
+    unsigned int nCount = 0;
+    for (CAddrIndexCursor cursor(*this, addrHash); cursor.Valid(); cursor.Next())
+        nCount++;
+    return nCount;
+}
+
+bool CTxDB::WriteAddressUnspent(const CAddressUnspentKey& key, const CAddressUnspentValue& value)
+{
+    return Write(make_pair(string("aun"), key), value);
+}
+
+bool CTxDB::EraseAddressUnspent(const CAddressUnspentKey& key)
+{
+    return Erase(make_pair(string("aun"), key));
+}
+
+bool CTxDB::ReadAddressUnspent(unsigned char addressType, const uint160& addressHash, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent)
+{
+    vUnspent.clear();
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("aun") << addressType << addressHash;
+    try {
+        for (CTxDBCursor cursor(*this, ssPrefix.str()); cursor.Valid(); cursor.Next())
+        {
+            CDataStream ssKey(cursor.GetKey().data(), cursor.GetKey().data() + cursor.GetKey().size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            CAddressUnspentKey key;
+            ssKey >> strType;
+            ssKey >> key;
+            CDataStream ssValue(cursor.GetValue().data(), cursor.GetValue().data() + cursor.GetValue().size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vUnspent.push_back(make_pair(key, value));
+        }
+    }
+    catch (std::exception &e) {
+        return error("ReadAddressUnspent() : deserialize error");
+    }
+    return true;
+}
+
+bool CTxDB::WriteAddressDelta(const CAddressDeltaKey& key, int64_t nDelta)
+{
+    return Write(make_pair(string("adt"), key), nDelta);
+}
+
+bool CTxDB::EraseAddressDelta(const CAddressDeltaKey& key)
+{
+    return Erase(make_pair(string("adt"), key));
+}
+
+bool CTxDB::ReadAddressBalance(unsigned char addressType, const uint160& addressHash, int64_t& nBalance, int64_t& nReceived)
+{
+    nBalance = 0;
+    nReceived = 0;
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("adt") << addressType << addressHash;
+    try {
+        for (CTxDBCursor cursor(*this, ssPrefix.str()); cursor.Valid(); cursor.Next())
+        {
+            CDataStream ssValue(cursor.GetValue().data(), cursor.GetValue().data() + cursor.GetValue().size(), SER_DISK, CLIENT_VERSION);
+            int64_t nDelta;
+            ssValue >> nDelta;
+            nBalance += nDelta;
+            if (nDelta > 0)
+                nReceived += nDelta;
+        }
+    }
+    catch (std::exception &e) {
+        return error("ReadAddressBalance() : deserialize error");
+    }
+    return true;
+}
+
+bool CTxDB::WriteSpentIndex(const COutPoint& outpoint, const CSpentIndexValue& value)
+{
+    return Write(make_pair(string("spt"), outpoint), value);
+}
+
+bool CTxDB::EraseSpentIndex(const COutPoint& outpoint)
+{
+    return Erase(make_pair(string("spt"), outpoint));
+}
+
+bool CTxDB::ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value)
+{
+    return Read(make_pair(string("spt"), outpoint), value);
+}
+
+// Erased through ordinary transactions, so entries still waiting for the
+// next commit point go as well, and the commit points pace the writes
+bool CTxDB::WipeAddressIndexes()
+{
+    const char* pszPrefixes[] = { "aun", "adt", "spt" };
+    unsigned int nErased = 0;
+    for (unsigned int i = 0; i < sizeof(pszPrefixes) / sizeof(pszPrefixes[0]); i++)
+    {
+        CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+        ssPrefix << string(pszPrefixes[i]);
+        // The cursor reads a snapshot, so erasing behind it is safe
+        TxnBegin();
+        for (CTxDBCursor cursor(*this, ssPrefix.str()); cursor.Valid(); cursor.Next())
+        {
+            BatchDelete(cursor.GetKey());
+            if (++nErased % 10000 == 0)
+            {
+                if (!TxnCommit())
+                    return error("WipeAddressIndexes() : TxnCommit failed");
+                TxnBegin();
+            }
+        }
+        if (!TxnCommit())
+            return error("WipeAddressIndexes() : TxnCommit failed");
+    }
+    LogPrintf("WipeAddressIndexes() : erased %u entries\n", nErased);
+    return true;
+}
+
+bool CTxDB::ReadFlag(const std::string& strName, bool& fValue)
+{
+    char ch;
+    if (!Read(make_pair(string("flag"), strName), ch))
+        return false;
+    fValue = (ch == '1');
+    return true;
+}
+
+bool CTxDB::WriteFlag(const std::string& strName, bool fValue)
+{
+    return Write(make_pair(string("flag"), strName), fValue ? '1' : '0');
+}
+
+// Convert address index entries written in the old format, one vector of
+// transaction hashes per address under the "adr" prefix, into height ordered
+// "adx" entries. Heights are recovered from the transaction index; hashes of
+// transactions that are no longer in the main chain are dropped. Once done the
+// "addrindexheightordered" flag is set, so later starts skip the scan.
+bool CTxDB::UpgradeAddrIndex()
+{
+    bool fUpgraded = false;
+    if (ReadFlag("addrindexheightordered", fUpgraded) && fUpgraded)
+        return true;
+
+    map<pair<unsigned int, unsigned int>, int> mapBlockHeight;
+    unsigned int nConverted = 0;
+
+    // Iterators only see what has reached LevelDB
+    if (!Commit(true))
+        return false;
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("adr"), uint160(0));
+    iterator->Seek(ssStartKey.str());
+    while (iterator->Valid())
+    {
+        boost::this_thread::interruption_point();
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "adr")
+            break;
+
+        if (mapBlockHeight.empty())
+        {
+            for (CBlockIndex* pindex = pindexBest; pindex; pindex = pindex->pprev)
+                mapBlockHeight[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex->nHeight;
+        }
+
+        uint160 addrHash;
+        vector<uint256> txHashes;
+        try {
+            ssKey >> addrHash;
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue.write(iterator->value().data(), iterator->value().size());
+            ssValue >> txHashes;
+        }
+        catch (std::exception &e) {
+            delete iterator;
+            return error("UpgradeAddrIndex() : deserialize error");
+        }
+
+        TxnBegin();
+        BOOST_FOREACH(const uint256& txHash, txHashes)
+        {
+            CTxIndex txindex;
+            if (!ReadTxIndex(txHash, txindex))
+                continue;
+            map<pair<unsigned int, unsigned int>, int>::iterator mi = mapBlockHeight.find(make_pair(txindex.pos.nFile, txindex.pos.nBlockPos));
+            if (mi == mapBlockHeight.end())
+                continue;
+            WriteAddrIndex(addrHash, mi->second, txHash);
+        }
+        BatchDelete(iterator->key().ToString());
+        if (!TxnCommit())
+        {
+            delete iterator;
+            return error("UpgradeAddrIndex() : TxnCommit failed");
         }
+
+        nConverted++;
+        iterator->Next();
+    }
+    delete iterator;
+
+    TxnBegin();
+    WriteFlag("addrindexheightordered", true);
+    if (!TxnCommit())
+        return error("UpgradeAddrIndex() : TxnCommit failed");
+
+    if (nConverted > 0)
+        LogPrintf("UpgradeAddrIndex() : converted the address index of %u addresses\n", nConverted);
+    return true;
+}
+
+// Undo records from before CBlockUndo stored its version came in two layouts,
+// with and without vPrevCoins, that cannot be told apart reliably. They are
+// dropped instead of converted: DisconnectBlock takes a block that has no
+// undo record back through DisconnectInputs, as it did before undo records.
+bool CTxDB::UpgradeBlockUndo()
+{
+    bool fVersioned = false;
+    if (ReadFlag("versionedundo", fVersioned) && fVersioned)
+        return true;
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("blockundo");
+    unsigned int nErased = 0;
+    TxnBegin();
+    for (CTxDBCursor cursor(*this, ssPrefix.str()); cursor.Valid(); cursor.Next())
+    {
+        BatchDelete(cursor.GetKey());
+        if (++nErased % 10000 == 0)
+        {
+            if (!TxnCommit())
+                return error("UpgradeBlockUndo() : TxnCommit failed");
+            TxnBegin();
+        }
+    }
+    WriteFlag("versionedundo", true);
+    if (!TxnCommit())
+        return error("UpgradeBlockUndo() : TxnCommit failed");
+
+    if (nErased > 0)
+        LogPrintf("UpgradeBlockUndo() : dropped %u undo records written without a version\n", nErased);
+    return true;
+}
+
+// Writes serialized objects to a snapshot file and hashes what it writes
+class CSnapshotWriter
+{
+private:
+    FILE* file;
+    CHashWriter hasher;
+
+public:
+    CSnapshotWriter(FILE* fileIn) : file(fileIn), hasher(SER_GETHASH, 0) {}
+
+    template<typename T>
+    bool Write(const T& obj)
+    {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << obj;
+        hasher.write(&ss[0], ss.size());
+        return fwrite(&ss[0], 1, ss.size(), file) == ss.size();
+    }
+
+    // Append the checksum of everything written so far
+    bool Finish()
+    {
+        uint256 hash = hasher.GetHash();
+        return fwrite(&hash, 1, sizeof(hash), file) == sizeof(hash);
     }
 };
 
-// When performing a read, if we have an active batch we need to check it first
-// before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
-bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
-    *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
+// Double SHA256 of a snapshot file without its checksum, and the checksum it ends with
+static bool ReadSnapshotChecksum(const string& strFile, uint256& hashComputed, uint256& hashStored)
+{
+    FILE* file = fopen(strFile.c_str(), "rb");
+    if (!file)
+        return false;
+    if (fseek(file, 0, SEEK_END) != 0)
+    {
+        fclose(file);
+        return false;
+    }
+    long nSize = ftell(file);
+    if (nSize < (long)sizeof(uint256))
+    {
+        fclose(file);
+        return false;
     }
-    return scanner.foundEntry;
+    rewind(file);
+
+    CHashWriter hasher(SER_GETHASH, 0);
+    vector<char> vBuf(1 << 20);
+    long nLeft = nSize - sizeof(uint256);
+    while (nLeft > 0)
+    {
+        size_t nChunk = std::min((long)vBuf.size(), nLeft);
+        if (fread(&vBuf[0], 1, nChunk, file) != nChunk)
+        {
+            fclose(file);
+            return false;
+        }
+        hasher.write(&vBuf[0], nChunk);
+        nLeft -= nChunk;
+    }
+    bool fOk = fread(&hashStored, 1, sizeof(hashStored), file) == sizeof(hashStored);
+    fclose(file);
+    hashComputed = hasher.GetHash();
+    return fOk;
 }
 
-bool CTxDB::WriteAddrIndex(uint160 addrHash, uint256 txHash)
+// Write the unspent output state at the current best block, together with the
+// block index of the main chain, to strFile. The caller holds cs_main so the
+// chain cannot move while the snapshot is taken.
+bool CTxDB::DumpSnapshot(const string& strFile, CSnapshotHeader& header, uint64_t& nCoinsRet, uint256& hashChecksumRet, string& strError)
 {
-    std::vector<uint256> txHashes;
-    if(!ReadAddrIndex(addrHash, txHashes))
+    AssertLockHeld(cs_main);
+    nCoinsRet = 0;
+
+    // Iterators only see what has reached LevelDB
+    if (!pcoinsTip->Flush(*this, true) || !Commit(true))
+    {
+        strError = "cannot commit pending changes";
+        return false;
+    }
+
+    vector<CBlockIndex*> vChain;
+    for (CBlockIndex* pindex = pindexBest; pindex; pindex = pindex->pprev)
+        vChain.push_back(pindex);
+    reverse(vChain.begin(), vChain.end());
+
+    FILE* file = fopen(strFile.c_str(), "wb");
+    if (!file)
+    {
+        strError = "cannot open " + strFile;
+        return false;
+    }
+
+    memcpy(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart));
+    header.hashBlock = pindexBest->GetBlockHash();
+    header.nHeight = pindexBest->nHeight;
+    header.nBlockIndexCount = vChain.size();
+
+    CSnapshotWriter writer(file);
+    bool fOk = writer.Write(header);
+    BOOST_FOREACH(CBlockIndex* pindex, vChain)
+    {
+        if (!fOk)
+            break;
+        fOk = writer.Write(CDiskBlockIndex(pindex));
+    }
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("tx"), uint256(0));
+    iterator->Seek(ssStartKey.str());
+    while (fOk && iterator->Valid())
     {
-	txHashes.push_back(txHash);
-        return Write(make_pair(string("adr"), addrHash), txHashes);
+        boost::this_thread::interruption_point();
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "tx")
+            break;
+
+        CSnapshotCoins entry;
+        ssKey >> entry.hash;
+        CTxIndex txindex;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        ssValue >> txindex;
+        iterator->Next();
+
+        bool fUnspent = false;
+        entry.vchSpent.assign((txindex.vSpent.size() + 7) / 8, 0);
+        for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+        {
+            if (txindex.vSpent[i].IsNull())
+                fUnspent = true;
+            else
+                entry.vchSpent[i / 8] |= (1 << (i % 8));
+        }
+        if (!fUnspent)
+            continue;
+
+        if (!pcoinsTip->GetCoins(*this, entry.hash, txindex, entry.coins))
+        {
+            strError = "cannot read the outputs of " + entry.hash.ToString();
+            fOk = false;
+            break;
+        }
+        fOk = writer.Write((unsigned char)1) && writer.Write(entry);
+        nCoinsRet++;
+    }
+    delete iterator;
+
+    // Coins read for the snapshot are not worth keeping in memory
+    pcoinsTip->Flush(*this);
+
+    if (fOk)
+        fOk = writer.Write((unsigned char)0) && writer.Finish();
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk)
+    {
+        if (strError.empty())
+            strError = "cannot write " + strFile;
+        return false;
     }
+
+    uint256 hash;
+    if (!ReadSnapshotChecksum(strFile, hashChecksumRet, hash) || hash != hashChecksumRet)
+    {
+        strError = "cannot read back " + strFile;
+        return false;
+    }
+    return true;
+}
+
+// Fill an empty database from a snapshot written by DumpSnapshot. Blocks
+// up to the snapshot have no data on this node. Their index entries and the
+// positions of their transactions are kept as they were, so stake kernels
+// hash the same and positions stay distinct, but with SNAPSHOT_BLOCK_FILE set
+// in the file number, so no block file is ever opened for them.
+bool CTxDB::LoadSnapshot(const string& strFile, string& strError)
+{
+    uint256 hashChecksum, hashStored;
+    if (!ReadSnapshotChecksum(strFile, hashChecksum, hashStored))
+    {
+        strError = "cannot read " + strFile;
+        return false;
+    }
+    if (hashChecksum != hashStored)
+    {
+        strError = "checksum mismatch in " + strFile;
+        return false;
+    }
+    // The file checksum only catches corruption. Whoever wrote the file chose
+    // the outputs in it, so it has to be checked against a hash the user got
+    // from somewhere they trust.
+    if (mapArgs.count("-snapshothash"))
+    {
+        if (uint256(GetArg("-snapshothash", "")) != hashChecksum)
+        {
+            strError = "snapshot checksum " + hashChecksum.GetHex() + " does not match -snapshothash";
+            return false;
+        }
+    }
+    else if (!GetBoolArg("-allowunverifiedsnapshot", false))
+    {
+        strError = "-loadsnapshot requires -snapshothash=<hash>, this snapshot has checksum " + hashChecksum.GetHex();
+        return false;
+    }
+    else
+    {
+        LogPrintf("*** WARNING: loading UTXO snapshot %s without -snapshothash. Its outputs are not verified,\n", strFile);
+        LogPrintf("*** WARNING: a forged snapshot can make this node accept invalid coins. Checksum %s\n", hashChecksum.GetHex());
+    }
+
+    CAutoFile filein = CAutoFile(fopen(strFile.c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+    {
+        strError = "cannot open " + strFile;
+        return false;
+    }
+
+    CSnapshotHeader header;
+    uint64_t nCoins = 0;
+    try {
+        filein >> header;
+        if (header.nSnapshotVersion != CSnapshotHeader::CURRENT_VERSION ||
+            memcmp(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart)) != 0 ||
+            header.fLowMem != CSnapshotHeader().fLowMem)
+        {
+            strError = "snapshot is for another network or version";
+            return false;
+        }
+
+        // The block index must be a single chain from our genesis block to
+        // the snapshot block, agreeing with the checkpoints
+        TxnBegin();
+        uint256 hashPrev = 0;
+        for (unsigned int i = 0; i < header.nBlockIndexCount; i++)
+        {
+            boost::this_thread::interruption_point();
+            CDiskBlockIndex diskindex;
+            filein >> diskindex;
+            CBlock block;
+            block.nVersion       = diskindex.nVersion;
+            block.hashPrevBlock  = diskindex.hashPrev;
+            block.hashMerkleRoot = diskindex.hashMerkleRoot;
+            block.nTime          = diskindex.nTime;
+            block.nBits          = diskindex.nBits;
+            block.nNonce         = diskindex.nNonce;
+            uint256 hash = block.GetHash();
+            if (diskindex.GetBlockHash() != hash || diskindex.hashPrev != hashPrev || (i == 0 && hash != Params().HashGenesisBlock()) ||
+                diskindex.nHeight != (int)i || !Checkpoints::CheckHardened(diskindex.nHeight, hash))
+            {
+                TxnAbort();
+                strError = strprintf("snapshot block index is broken at height %u", i);
+                return false;
+            }
+            diskindex.nFile |= SNAPSHOT_BLOCK_FILE;
+            if (i + 1 == header.nBlockIndexCount)
+                diskindex.hashNext = 0;
+            WriteBlockIndex(diskindex);
+            hashPrev = hash;
+
+            if (i % 10000 == 9999)
+            {
+                if (!TxnCommit())
+                {
+                    strError = "cannot write the snapshot block index to the database";
+                    return false;
+                }
+                TxnBegin();
+            }
+        }
+        if (hashPrev != header.hashBlock || (int)header.nBlockIndexCount != header.nHeight + 1)
+        {
+            TxnAbort();
+            strError = "snapshot block index does not end at the snapshot block";
+            return false;
+        }
+
+        unsigned char fMore;
+        filein >> fMore;
+        while (fMore)
+        {
+            boost::this_thread::interruption_point();
+            CSnapshotCoins entry;
+            filein >> entry;
+
+            entry.coins.pos.nFile |= SNAPSHOT_BLOCK_FILE;
+            CTxIndex txindex(entry.coins.pos, entry.coins.vout.size());
+            // Spent by a transaction we do not have either
+            for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+                if (i / 8 < entry.vchSpent.size() && (entry.vchSpent[i / 8] & (1 << (i % 8))))
+                    txindex.vSpent[i] = CDiskTxPos(SNAPSHOT_BLOCK_FILE, 0, 0);
+            UpdateTxIndex(entry.hash, txindex);
+            WriteCoins(entry.hash, entry.coins);
+
+            if (++nCoins % 10000 == 0)
+            {
+                if (!TxnCommit())
+                {
+                    strError = "cannot write the snapshot outputs to the database";
+                    return false;
+                }
+                TxnBegin();
+            }
+            filein >> fMore;
+        }
+
+        Write(string("snapshot"), header);
+        WriteHashBestChain(header.hashBlock);
+        if (!TxnCommit() || !Commit(true))
+        {
+            strError = "cannot write the snapshot to the database";
+            return false;
+        }
+    }
+    catch (std::exception &e) {
+        TxnAbort();
+        strError = "snapshot file is truncated or corrupt";
+        return false;
+    }
+
+    LogPrintf("LoadSnapshot() : loaded %u blocks and the outputs of %u transactions up to %s at height %d\n",
+        header.nBlockIndexCount, nCoins, header.hashBlock.ToString(), header.nHeight);
+    return true;
+}
+
+bool CTxDB::ReadSnapshotHeader(CSnapshotHeader& header)
+{
+    return Read(string("snapshot"), header);
+}
+
+CTxDBCursor::CTxDBCursor(CTxDB& txdb, const string& strPrefixIn, bool fReverseIn)
+{
+    pdb = txdb.pdb;
+    strPrefix = strPrefixIn;
+    fReverse = fReverseIn;
+    fValid = false;
+    fFromDb = false;
+    {
+        // Commit() moves the pending changes to LevelDB while holding
+        // cs_pending, so the snapshot and the copy taken here agree
+        LOCK(CTxDB::cs_pending);
+        psnapshot = pdb->GetSnapshot();
+        for (CTxDB::BatchOverlay::const_iterator it = CTxDB::pendingOverlay.begin(); it != CTxDB::pendingOverlay.end(); ++it)
+            if (it->first.compare(0, strPrefix.size(), strPrefix) == 0)
+                mapOverlay[it->first] = it->second;
+    }
+    if (txdb.activeOverlay)
+    {
+        for (CTxDB::BatchOverlay::const_iterator it = txdb.activeOverlay->begin(); it != txdb.activeOverlay->end(); ++it)
+            if (it->first.compare(0, strPrefix.size(), strPrefix) == 0)
+                mapOverlay[it->first] = it->second;
+    }
+    // Walking backwards, itOverlay points just past the next entry to take
+    itOverlay = fReverse ? mapOverlay.end() : mapOverlay.begin();
+
+    leveldb::ReadOptions options;
+    options.snapshot = psnapshot;
+    piter = pdb->NewIterator(options);
+    if (!fReverse)
+        piter->Seek(strPrefix);
     else
     {
-	if(std::find(txHashes.begin(), txHashes.end(), txHash) == txHashes.end()) 
-    	{
-    	    txHashes.push_back(txHash);
-            return Write(make_pair(string("adr"), addrHash), txHashes);
-	}
-	else
-	{
-	    return true; // already have this tx hash
-	}
+        // Start at the last key before the first one past the prefix
+        string strEnd = strPrefix;
+        while (!strEnd.empty() && (unsigned char)strEnd[strEnd.size() - 1] == 0xff)
+            strEnd.erase(strEnd.size() - 1);
+        if (strEnd.empty())
+            piter->SeekToLast();
+        else
+        {
+            strEnd[strEnd.size() - 1]++;
+            piter->Seek(strEnd);
+            if (piter->Valid())
+                piter->Prev();
+            else
+                piter->SeekToLast();
+        }
+    }
+    Settle();
+}
+
+CTxDBCursor::~CTxDBCursor()
+{
+    delete piter;
+    pdb->ReleaseSnapshot(psnapshot);
+}
+
+// Move to the first key at or after both positions, in the direction of the
+// walk, that is not deleted by the overlay, taking the overlaid value where
+// both have the key
+void CTxDBCursor::Settle()
+{
+    fValid = false;
+    while (true)
+    {
+        bool fDb = piter->Valid() && piter->key().starts_with(strPrefix);
+        bool fOverlay = itOverlay != (fReverse ? mapOverlay.begin() : mapOverlay.end());
+        if (!fDb && !fOverlay)
+            return;
+        OverlayMap::const_iterator it = itOverlay;
+        if (fOverlay && fReverse)
+            --it;
+        int nCompare = !fDb ? 1 : (!fOverlay ? -1 : piter->key().compare(it->first));
+        if (fReverse && fDb && fOverlay)
+            nCompare = -nCompare;
+        if (nCompare < 0)
+        {
+            strKey.assign(piter->key().data(), piter->key().size());
+            strValue.assign(piter->value().data(), piter->value().size());
+            fValid = true;
+            fFromDb = true;
+            return;
+        }
+        if (nCompare == 0)
+        {
+            if (fReverse)
+                piter->Prev();
+            else
+                piter->Next();
+        }
+        if (fReverse)
+            itOverlay = it;
+        else
+            ++itOverlay;
+        if (!it->second.fDeleted)
+        {
+            strKey = it->first;
+            strValue = it->second.strValue;
+            fValid = true;
+            fFromDb = false;
+            return;
+        }
+    }
+}
+
+void CTxDBCursor::Next()
+{
+    if (!fValid)
+        return;
+    if (fFromDb)
+    {
+        if (fReverse)
+            piter->Prev();
+        else
+            piter->Next();
+    }
+    Settle();
+}
+
+static string AddrIndexPrefix(const uint160& addrHash)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("adx") << addrHash;
+    return ssPrefix.str();
+}
+
+CAddrIndexCursor::CAddrIndexCursor(CTxDB& txdb, const uint160& addrHashIn, bool fReverse) : cursor(txdb, AddrIndexPrefix(addrHashIn), fReverse)
+{
+    addrHash = addrHashIn;
+    fValid = false;
+    ReadKey();
+}
+
+CAddrIndexCursor::~CAddrIndexCursor()
+{
+}
+
+void CAddrIndexCursor::ReadKey()
+{
+    fValid = false;
+    if (!cursor.Valid())
+        return;
+    try {
+        CDataStream ssKey(cursor.GetKey().data(), cursor.GetKey().data() + cursor.GetKey().size(), SER_DISK, CLIENT_VERSION);
+        string strType;
+        ssKey >> strType;
+        if (strType != "adx")
+            return;
+        ssKey >> key;
+    }
+    catch (std::exception &e) {
+        return;
     }
+    fValid = (key.addrHash == addrHash);
 }
 
-bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes)
+void CAddrIndexCursor::Next()
 {
-    return Read(make_pair(string("adr"), addrHash), txHashes);
+    if (!fValid)
+        return;
+    cursor.Next();
+    ReadKey();
+}
+
+unsigned int CAddrIndexCursor::Skip(unsigned int n)
+{
+    unsigned int nSkipped = 0;
+    while (fValid && nSkipped < n)
+    {
+        Next();
+        nSkipped++;
+    }
+    return nSkipped;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -257,10 +1178,7 @@ bool CTxDB::ContainsTx(uint256 hash)
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
 {
-    tx.SetNull();
-    if (!ReadTxIndex(hash, txindex))
-        return false;
-    return (tx.ReadFromDisk(txindex.pos));
+    return tx.ReadFromDisk(*this, hash, txindex);
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx)
@@ -280,11 +1198,45 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+bool CTxDB::ReadCoins(uint256 hash, CCoins& coins)
+{
+    coins.SetNull();
+    return Read(make_pair(string("coins"), hash), coins);
+}
+
+bool CTxDB::WriteCoins(uint256 hash, const CCoins& coins)
+{
+    return Write(make_pair(string("coins"), hash), coins);
+}
+
+bool CTxDB::EraseCoins(uint256 hash)
+{
+    return Erase(make_pair(string("coins"), hash));
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
+bool CTxDB::ReadBlockUndo(uint256 hash, CBlockUndo& undo)
+{
+    undo.SetNull();
+    if (!Read(make_pair(string("blockundo"), hash), undo))
+        return false;
+    return undo.nVersion == CBlockUndo::CURRENT_VERSION;
+}
+
+bool CTxDB::WriteBlockUndo(uint256 hash, const CBlockUndo& undo)
+{
+    return Write(make_pair(string("blockundo"), hash), undo);
+}
+
+bool CTxDB::EraseBlockUndo(uint256 hash)
+{
+    return Erase(make_pair(string("blockundo"), hash));
+}
+
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
     return Read(string("hashBestChain"), hashBestChain);
@@ -311,96 +1263,374 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (AllocBlockIndex()) CBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+// Block index snapshot, written at shutdown and mapped at startup so that the
+// index can be rebuilt without deserializing and hashing every LevelDB entry.
+// Records are fixed-size and in native byte order, and only meant to be read
+// back by the same build on the same machine. The file is removed once it has
+// been loaded, so it can never describe an index that changed after it.
+static const unsigned int BLOCKINDEX_SNAPSHOT_MAGIC = 0x78646962; // "bidx"
+static const unsigned int BLOCKINDEX_SNAPSHOT_VERSION = 1;
+static const unsigned int BLOCKINDEX_SNAPSHOT_SAMPLES = 64;
+
+struct CBlockIndexSnapshotHeader
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
-        return true;
-    }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+    unsigned int nMagic;
+    unsigned int nVersion;
+    unsigned int nRecordSize;
+    unsigned int nRecords;
+    uint64_t nChecksum;
+    uint256 hashBestChain;
+};
+
+struct CBlockIndexSnapshotRecord
+{
+    uint256 hashBlock;
+    uint256 hashPrev;
+    uint256 hashNext;
+    uint256 nChainTrust;
+    uint256 bnStakeModifierV2;
+    uint256 hashProof;
+    uint256 hashMerkleRoot;
+    uint256 prevoutStakeHash;
+    uint64_t nStakeModifier;
+    int64_t nMint;
+    int64_t nMoneySupply;
+    int64_t nLastReward;
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    int nHeight;
+    unsigned int nFlags;
+    unsigned int prevoutStakeN;
+    unsigned int nStakeTime;
+    int nVersion;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+};
+
+static boost::filesystem::path BlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blockindex.dat";
+}
+
+// Cheap integrity check over the records, not meant to resist tampering
+static uint64_t BlockIndexSnapshotChecksum(uint64_t nChecksum, const unsigned char* pch, size_t nSize)
+{
+    for (size_t i = 0; i < nSize; i++)
+        nChecksum = (nChecksum ^ pch[i]) * 0x100000001b3ULL;
+    return nChecksum;
+}
+
+static bool SortByHeight(const CBlockIndex* pa, const CBlockIndex* pb)
+{
+    return pa->nHeight < pb->nHeight;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    if (pindexBest == NULL || mapBlockIndex.empty())
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    // Entries that only stand in for a block referenced by another one carry
+    // no header, they are recreated from the references when loading
+    vector<CBlockIndex*> vIndex;
+    vIndex.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+        if (item.second->nBits != 0)
+            vIndex.push_back(item.second);
+    sort(vIndex.begin(), vIndex.end(), SortByHeight);
+
+    CBlockIndexSnapshotHeader header = CBlockIndexSnapshotHeader();
+    header.nMagic = BLOCKINDEX_SNAPSHOT_MAGIC;
+    header.nVersion = BLOCKINDEX_SNAPSHOT_VERSION;
+    header.nRecordSize = sizeof(CBlockIndexSnapshotRecord);
+    header.nRecords = vIndex.size();
+    header.nChecksum = 0xcbf29ce484222325ULL;
+    header.hashBestChain = hashBestChain;
+
+    boost::filesystem::path pathTmp = BlockIndexSnapshotPath();
+    pathTmp += ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : cannot open %s", pathTmp.string());
+
+    // Header first as a placeholder, rewritten below once the checksum is known
+    bool fOk = fwrite(&header, sizeof(header), 1, file) == 1;
+    BOOST_FOREACH(const CBlockIndex* pindex, vIndex)
     {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
+        if (!fOk)
             break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
+        CBlockIndexSnapshotRecord rec = CBlockIndexSnapshotRecord();
+        rec.hashBlock = pindex->GetBlockHash();
+        rec.hashPrev = pindex->pprev ? pindex->pprev->GetBlockHash() : 0;
+        rec.hashNext = pindex->pnext ? pindex->pnext->GetBlockHash() : 0;
+        rec.nChainTrust = pindex->nChainTrust;
 #ifndef LOWMEM
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nLastReward    = diskindex.nLastReward;
+        rec.bnStakeModifierV2 = pindex->bnStakeModifierV2;
+        rec.nMint = pindex->nMint;
+        rec.nMoneySupply = pindex->nMoneySupply;
+        rec.nLastReward = pindex->nLastReward;
 #endif
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
+        rec.hashProof = pindex->hashProof;
+        rec.hashMerkleRoot = pindex->hashMerkleRoot;
+        rec.prevoutStakeHash = pindex->prevoutStake.hash;
+        rec.prevoutStakeN = pindex->prevoutStake.n;
+        rec.nStakeModifier = pindex->nStakeModifier;
+        rec.nFile = pindex->nFile;
+        rec.nBlockPos = pindex->nBlockPos;
+        rec.nHeight = pindex->nHeight;
+        rec.nFlags = pindex->nFlags;
+        rec.nStakeTime = pindex->nStakeTime;
+        rec.nVersion = pindex->nVersion;
+        rec.nTime = pindex->nTime;
+        rec.nBits = pindex->nBits;
+        rec.nNonce = pindex->nNonce;
+        header.nChecksum = BlockIndexSnapshotChecksum(header.nChecksum, (const unsigned char*)&rec, sizeof(rec));
+        fOk = fwrite(&rec, sizeof(rec), 1, file) == 1;
+    }
+    if (fOk)
+        fOk = fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, BlockIndexSnapshotPath()))
+    {
+        boost::filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : failed to write %s", pathTmp.string());
+    }
+
+    LogPrintf("WriteBlockIndexSnapshot() : wrote %u entries in %dms\n", header.nRecords, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    boost::filesystem::path path = BlockIndexSnapshotPath();
+    if (!boost::filesystem::exists(path))
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    bool fLoaded = false;
+    try
+    {
+        interprocess::file_mapping mapping(path.string().c_str(), interprocess::read_only);
+        interprocess::mapped_region region(mapping, interprocess::read_only);
+        const unsigned char* pchBegin = (const unsigned char*)region.get_address();
+        size_t nSize = region.get_size();
+
+        CBlockIndexSnapshotHeader header;
+        if (nSize < sizeof(header))
+            throw runtime_error("truncated header");
+        memcpy(&header, pchBegin, sizeof(header));
+        if (header.nMagic != BLOCKINDEX_SNAPSHOT_MAGIC || header.nVersion != BLOCKINDEX_SNAPSHOT_VERSION ||
+            header.nRecordSize != sizeof(CBlockIndexSnapshotRecord))
+            throw runtime_error("unknown format");
+        if (header.nRecords == 0 || nSize != sizeof(header) + (size_t)header.nRecords * sizeof(CBlockIndexSnapshotRecord))
+            throw runtime_error("unexpected size");
+        const unsigned char* pchRecords = pchBegin + sizeof(header);
+        if (BlockIndexSnapshotChecksum(0xcbf29ce484222325ULL, pchRecords, nSize - sizeof(header)) != header.nChecksum)
+            throw runtime_error("checksum mismatch");
+
+        // LevelDB remains authoritative: the snapshot must end at its best
+        // block and agree with it on a sample of entries spread over the file
+        uint256 hashBestChainDb;
+        if (!ReadHashBestChain(hashBestChainDb) || hashBestChainDb != header.hashBestChain)
+            throw runtime_error("best chain differs from the database");
+        for (unsigned int i = 0; i < BLOCKINDEX_SNAPSHOT_SAMPLES; i++)
+        {
+            CBlockIndexSnapshotRecord rec;
+            size_t nRecord = (size_t)(header.nRecords - 1) * i / (BLOCKINDEX_SNAPSHOT_SAMPLES - 1);
+            memcpy(&rec, pchRecords + nRecord * sizeof(rec), sizeof(rec));
+            CDiskBlockIndex diskindex;
+            if (!Read(make_pair(string("blockindex"), rec.hashBlock), diskindex))
+                throw runtime_error("entry missing from the database");
+            if (diskindex.hashPrev != rec.hashPrev || diskindex.hashNext != rec.hashNext ||
+                diskindex.nFile != rec.nFile || diskindex.nBlockPos != rec.nBlockPos ||
+                diskindex.nHeight != rec.nHeight || diskindex.nFlags != rec.nFlags ||
+                diskindex.nStakeModifier != rec.nStakeModifier || diskindex.hashMerkleRoot != rec.hashMerkleRoot ||
+                diskindex.nTime != rec.nTime || diskindex.nBits != rec.nBits || diskindex.nNonce != rec.nNonce)
+                throw runtime_error("entry differs from the database");
+        }
+
+        // Records are in height order, so the parent of each one is complete
+        // by the time its skip pointer is built
+        for (unsigned int i = 0; i < header.nRecords; i++)
+        {
+            CBlockIndexSnapshotRecord rec;
+            memcpy(&rec, pchRecords + (size_t)i * sizeof(rec), sizeof(rec));
+
+            CBlockIndex* pindexNew    = InsertBlockIndex(rec.hashBlock);
+            pindexNew->pprev          = InsertBlockIndex(rec.hashPrev);
+            pindexNew->pnext          = InsertBlockIndex(rec.hashNext);
+            pindexNew->nFile          = rec.nFile;
+            pindexNew->nBlockPos      = rec.nBlockPos;
+            pindexNew->nHeight        = rec.nHeight;
+            pindexNew->nChainTrust    = rec.nChainTrust;
 #ifndef LOWMEM
-        pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
+            pindexNew->nMint          = rec.nMint;
+            pindexNew->nMoneySupply   = rec.nMoneySupply;
+            pindexNew->nLastReward    = rec.nLastReward;
 #endif
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+            pindexNew->nFlags         = rec.nFlags;
+            pindexNew->nStakeModifier = rec.nStakeModifier;
+#ifndef LOWMEM
+            pindexNew->bnStakeModifierV2 = rec.bnStakeModifierV2;
+#endif
+            pindexNew->prevoutStake   = COutPoint(rec.prevoutStakeHash, rec.prevoutStakeN);
+            pindexNew->nStakeTime     = rec.nStakeTime;
+            pindexNew->hashProof      = rec.hashProof;
+            pindexNew->nVersion       = rec.nVersion;
+            pindexNew->hashMerkleRoot = rec.hashMerkleRoot;
+            pindexNew->nTime          = rec.nTime;
+            pindexNew->nBits          = rec.nBits;
+            pindexNew->nNonce         = rec.nNonce;
+            pindexNew->BuildSkip();
+
+            if (pindexGenesisBlock == NULL && rec.hashBlock == Params().HashGenesisBlock())
+                pindexGenesisBlock = pindexNew;
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
         }
+        fLoaded = true;
+        LogPrintf("LoadBlockIndex() : loaded %u entries from the block index snapshot in %dms\n",
+            header.nRecords, GetTimeMillis() - nStart);
+    }
+    catch (std::exception& e)
+    {
+        LogPrintf("LoadBlockIndex() : ignoring block index snapshot: %s\n", e.what());
+    }
 
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    boost::filesystem::remove(path);
+    return fLoaded;
+}
 
-        iterator->Next();
+// Progress shared by the threads reading the block index out of LevelDB.
+// Creating entries in mapBlockIndex is serialized by cs, deserializing and
+// hashing the headers is not.
+struct CBlockIndexLoadState
+{
+    CCriticalSection cs;
+    unsigned int nLoaded;
+    bool fFailed;
+    string strError;
+};
+
+// Load the block index entries whose hash starts with a byte in [nBegin, nEnd)
+static void LoadBlockIndexRange(leveldb::DB* pdb, unsigned int nBegin, unsigned int nEnd, CBlockIndexLoadState* state)
+{
+    RenameThread("SocietyG-loadidx");
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    try
+    {
+        uint256 hashStart = 0;
+        *hashStart.begin() = (unsigned char)nBegin;
+        CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+        ssStartKey << make_pair(string("blockindex"), hashStart);
+        for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+        {
+            CDataStream ssKey(iterator->key().data(), iterator->key().data() + iterator->key().size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            ssKey >> strType;
+            if (strType != "blockindex")
+                break;
+            uint256 hashKey;
+            ssKey >> hashKey;
+            if (*hashKey.begin() >= nEnd)
+                break;
+
+            CDataStream ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            uint256 blockHash = diskindex.GetBlockHash();
+            uint256 nBlockTrust = diskindex.GetBlockTrust();
+
+            CBlockIndex* pindexNew;
+            {
+                LOCK(state->cs);
+                if (state->fFailed)
+                    break;
+                pindexNew          = InsertBlockIndex(blockHash);
+                pindexNew->pprev   = InsertBlockIndex(diskindex.hashPrev);
+                pindexNew->pnext   = InsertBlockIndex(diskindex.hashNext);
+
+                // Watch for genesis block
+                if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
+                    pindexGenesisBlock = pindexNew;
+
+                // NovaCoin: build setStakeSeen
+                if (diskindex.IsProofOfStake())
+                    setStakeSeen.insert(make_pair(diskindex.prevoutStake, diskindex.nStakeTime));
+                state->nLoaded++;
+            }
+
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            pindexNew->nHeight        = diskindex.nHeight;
+#ifndef LOWMEM
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nLastReward    = diskindex.nLastReward;
+#endif
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+#ifndef LOWMEM
+            pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
+#endif
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProof      = diskindex.hashProof;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            // Trust of this block alone for now, summed along the chain once
+            // every entry is in
+            pindexNew->nChainTrust    = nBlockTrust;
+
+            if (!pindexNew->CheckIndex())
+                throw runtime_error(strprintf("CheckIndex failed at %d", pindexNew->nHeight));
+        }
+    }
+    catch (std::exception& e)
+    {
+        LOCK(state->cs);
+        state->fFailed = true;
+        state->strError = e.what();
     }
     delete iterator;
+}
+
+bool CTxDB::LoadBlockIndexParallel()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // Split the key space by the first byte of the block hash
+    int nThreads = std::max(1, std::min(8, (int)boost::thread::hardware_concurrency()));
+    CBlockIndexLoadState state;
+    state.nLoaded = 0;
+    state.fFailed = false;
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&LoadBlockIndexRange, pdb, 256 * i / nThreads, 256 * (i + 1) / nThreads, &state));
+    threads.join_all();
+    if (state.fFailed)
+        return error("LoadBlockIndex() : %s", state.strError);
 
     boost::this_thread::interruption_point();
 
@@ -416,9 +1646,31 @@ bool CTxDB::LoadBlockIndex()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        pindex->nChainTrust += (pindex->pprev ? pindex->pprev->nChainTrust : 0);
+        pindex->BuildSkip();
     }
 
+    LogPrintf("LoadBlockIndex() : loaded %u entries from the database with %d threads in %dms\n",
+        state.nLoaded, nThreads, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    }
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we read it
+    // from the snapshot left by the last clean shutdown, or else scan it out
+    // of the DB and into mapBlockIndex.
+    if (!LoadBlockIndexSnapshot() && !LoadBlockIndexParallel())
+        return false;
+
+    boost::this_thread::interruption_point();
+
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -429,6 +1681,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    SetActiveChain(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -436,6 +1689,57 @@ bool CTxDB::LoadBlockIndex()
       hashBestChain.ToString(), nBestHeight, CBigNum(nBestChainTrust).ToString(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()));
 
+    // Anything written after the last commit point was never made durable and
+    // did not survive if we stopped uncleanly. The database goes back to the
+    // commit point as a whole, but the block data it refers to, from the
+    // commit point up to the best block, must have survived as well. Where
+    // it did not, the chain is rolled back to the last block that is intact.
+    CCommitPoint commitPoint;
+    if (ReadCommitPoint(commitPoint))
+    {
+        LogPrintf("LoadBlockIndex(): last commit point %s at %s\n", commitPoint.hashBestChain.ToString(),
+          DateTimeStrFormat("%x %H:%M:%S", commitPoint.nTime));
+        BlockMap::iterator mi = mapBlockIndex.find(commitPoint.hashBestChain);
+        if (mi == mapBlockIndex.end())
+            return error("CTxDB::LoadBlockIndex() : commit point %s not found in the block index", commitPoint.hashBestChain.ToString());
+        CBlockIndex* pindexCommit = mi->second;
+        if (pindexCommit != pindexBest)
+            LogPrintf("LoadBlockIndex(): best chain %s does not match the commit point\n", hashBestChain.ToString());
+
+        // The best chain from where it meets the commit point's chain
+        vector<CBlockIndex*> vCheck;
+        for (CBlockIndex* pindex = pindexBest; pindex; pindex = pindex->pprev)
+        {
+            vCheck.push_back(pindex);
+            if (pindexCommit->GetAncestor(pindex->nHeight) == pindex)
+                break;
+        }
+        CBlockIndex* pindexIntact = NULL;
+        for (vector<CBlockIndex*>::reverse_iterator it = vCheck.rbegin(); it != vCheck.rend(); ++it)
+        {
+            boost::this_thread::interruption_point();
+            CBlock block;
+            if (HaveBlockData(*it) && !block.ReadFromDisk(*it))
+            {
+                LogPrintf("LoadBlockIndex() : *** block data of %d %s did not survive\n", (*it)->nHeight, (*it)->GetBlockHash().ToString());
+                pindexIntact = (*it)->pprev;
+                break;
+            }
+        }
+        if (pindexIntact)
+        {
+            // Disconnecting the blocks above needs their data, so if that is
+            // gone too the database has to be rebuilt from the block files
+            LogPrintf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexIntact->nHeight);
+            CBlock block;
+            CTxDB txdb;
+            if (!block.ReadFromDisk(pindexIntact) || !block.SetBestChain(txdb, pindexIntact))
+                return error("LoadBlockIndex() : block database refers to block data that is lost, restart with a new data directory and -loadblock to rebuild it");
+            if (!pcoinsTip->Flush(txdb, true) || !txdb.Commit(true))
+                return error("LoadBlockIndex() : cannot commit the rolled back chain");
+        }
+    }
+
     // Load bnBestInvalidTrust, OK if it doesn't exist
     CBigNum bnBestInvalidTrust;
     ReadBestInvalidTrust(bnBestInvalidTrust);
@@ -456,6 +1760,9 @@ bool CTxDB::LoadBlockIndex()
         boost::this_thread::interruption_point();
         if (pindex->nHeight < nBestHeight-nCheckDepth)
             break;
+        // Nothing to check below a UTXO snapshot or pruned block data
+        if (!HaveBlockData(pindex))
+            break;
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("LoadBlockIndex() : block.ReadFromDisk failed");
@@ -7,7 +7,9 @@
 #define BITCOIN_LEVELDB_H
 
 #include "main.h"
+#include "coins.h"
 
+#include <limits>
 #include <map>
 #include <string>
 #include <vector>
@@ -15,6 +17,306 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+#include <boost/unordered_map.hpp>
+
+// Key of one address index entry. Entries are stored under the "adx" prefix
+// with an empty value, one per (address, height, transaction), so adding a
+// transaction to the index is a blind put instead of a read-modify-write of
+// an ever growing vector. The height is written big-endian so that LevelDB's
+// bytewise ordering returns the transactions of an address in chain order.
+class CAddrIndexKey
+{
+public:
+    uint160 addrHash;
+    int nHeight;
+    uint256 txHash;
+
+    CAddrIndexKey()
+    {
+        addrHash = 0;
+        nHeight = 0;
+        txHash = 0;
+    }
+
+    CAddrIndexKey(const uint160& addrHashIn, int nHeightIn, const uint256& txHashIn)
+    {
+        addrHash = addrHashIn;
+        nHeight = nHeightIn;
+        txHash = txHashIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(addrHash);
+        unsigned char chHeight[4];
+        if (!fRead)
+        {
+            unsigned int n = (unsigned int)nHeight;
+            chHeight[0] = (n >> 24) & 0xff;
+            chHeight[1] = (n >> 16) & 0xff;
+            chHeight[2] = (n >> 8) & 0xff;
+            chHeight[3] = n & 0xff;
+        }
+        READWRITE(FLATDATA(chHeight));
+        if (fRead)
+            const_cast<CAddrIndexKey*>(this)->nHeight = (int)(((unsigned int)chHeight[0] << 24) | ((unsigned int)chHeight[1] << 16) |
+                                                              ((unsigned int)chHeight[2] << 8) | (unsigned int)chHeight[3]);
+        READWRITE(txHash);
+    )
+};
+
+// Address types of the address indexes, from the destination an output pays to
+enum
+{
+    ADDRESSINDEX_PUBKEYHASH = 1,
+    ADDRESSINDEX_SCRIPTHASH = 2,
+};
+
+// Key of one unspent output in the address unspent index ("aun"), grouped by
+// the address it pays to.
+class CAddressUnspentKey
+{
+public:
+    unsigned char addressType;
+    uint160 addressHash;
+    uint256 txHash;
+    unsigned int nOut;
+
+    CAddressUnspentKey()
+    {
+        addressType = 0;
+        addressHash = 0;
+        txHash = 0;
+        nOut = 0;
+    }
+
+    CAddressUnspentKey(unsigned char addressTypeIn, const uint160& addressHashIn, const uint256& txHashIn, unsigned int nOutIn)
+    {
+        addressType = addressTypeIn;
+        addressHash = addressHashIn;
+        txHash = txHashIn;
+        nOut = nOutIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(addressType);
+        READWRITE(addressHash);
+        READWRITE(txHash);
+        READWRITE(nOut);
+    )
+};
+
+class CAddressUnspentValue
+{
+public:
+    int64_t nValue;
+    CScript scriptPubKey;
+    int nHeight;
+
+    CAddressUnspentValue()
+    {
+        nValue = 0;
+        nHeight = -1;
+    }
+
+    CAddressUnspentValue(int64_t nValueIn, const CScript& scriptPubKeyIn, int nHeightIn)
+    {
+        nValue = nValueIn;
+        scriptPubKey = scriptPubKeyIn;
+        nHeight = nHeightIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(scriptPubKey);
+        READWRITE(nHeight);
+    )
+};
+
+// Key of one balance change of an address in the address delta index ("adt"):
+// an output paying to it, or an input spending from it. The value is the
+// signed amount. The height is written big-endian as in CAddrIndexKey.
+class CAddressDeltaKey
+{
+public:
+    unsigned char addressType;
+    uint160 addressHash;
+    int nHeight;
+    uint256 txHash;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CAddressDeltaKey()
+    {
+        addressType = 0;
+        addressHash = 0;
+        nHeight = 0;
+        txHash = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+
+    CAddressDeltaKey(unsigned char addressTypeIn, const uint160& addressHashIn, int nHeightIn, const uint256& txHashIn, unsigned int nIndexIn, bool fSpendingIn)
+    {
+        addressType = addressTypeIn;
+        addressHash = addressHashIn;
+        nHeight = nHeightIn;
+        txHash = txHashIn;
+        nIndex = nIndexIn;
+        fSpending = fSpendingIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(addressType);
+        READWRITE(addressHash);
+        unsigned char chHeight[4];
+        if (!fRead)
+        {
+            unsigned int n = (unsigned int)nHeight;
+            chHeight[0] = (n >> 24) & 0xff;
+            chHeight[1] = (n >> 16) & 0xff;
+            chHeight[2] = (n >> 8) & 0xff;
+            chHeight[3] = n & 0xff;
+        }
+        READWRITE(FLATDATA(chHeight));
+        if (fRead)
+            const_cast<CAddressDeltaKey*>(this)->nHeight = (int)(((unsigned int)chHeight[0] << 24) | ((unsigned int)chHeight[1] << 16) |
+                                                                 ((unsigned int)chHeight[2] << 8) | (unsigned int)chHeight[3]);
+        READWRITE(txHash);
+        READWRITE(nIndex);
+        READWRITE(fSpending);
+    )
+};
+
+// Where an output was spent, stored under ("spt", outpoint) by the spent index
+class CSpentIndexValue
+{
+public:
+    uint256 txHash;
+    unsigned int nIn;
+    int nHeight;
+    int64_t nValue;
+    unsigned char addressType;
+    uint160 addressHash;
+
+    CSpentIndexValue()
+    {
+        txHash = 0;
+        nIn = 0;
+        nHeight = -1;
+        nValue = 0;
+        addressType = 0;
+        addressHash = 0;
+    }
+
+    CSpentIndexValue(const uint256& txHashIn, unsigned int nInIn, int nHeightIn, int64_t nValueIn, unsigned char addressTypeIn, const uint160& addressHashIn)
+    {
+        txHash = txHashIn;
+        nIn = nInIn;
+        nHeight = nHeightIn;
+        nValue = nValueIn;
+        addressType = addressTypeIn;
+        addressHash = addressHashIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txHash);
+        READWRITE(nIn);
+        READWRITE(nHeight);
+        READWRITE(nValue);
+        READWRITE(addressType);
+        READWRITE(addressHash);
+    )
+};
+
+// Last point at which block data and the transaction index were made durable
+// together. Written under "commitPoint" in the same synced LevelDB write as
+// the index changes it covers.
+class CCommitPoint
+{
+public:
+    uint256 hashBestChain;
+    int64_t nTime;
+
+    CCommitPoint()
+    {
+        hashBestChain = 0;
+        nTime = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBestChain);
+        READWRITE(nTime);
+    )
+};
+
+// Header of a UTXO snapshot file written by dumpsnapshot. It is followed by
+// the block index of the main chain from the genesis block up, one
+// CDiskBlockIndex per block, then the unspent output state as a series of
+// CSnapshotCoins each preceded by a 1 byte and terminated by a 0 byte, and
+// ends with the double SHA256 of everything before it.
+class CSnapshotHeader
+{
+public:
+    static const int CURRENT_VERSION = 1;
+
+    int nSnapshotVersion;
+    unsigned char pchMessageStart[4];
+    unsigned char fLowMem;
+    uint256 hashBlock;
+    int nHeight;
+    unsigned int nBlockIndexCount;
+
+    CSnapshotHeader()
+    {
+        nSnapshotVersion = CURRENT_VERSION;
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+#ifdef LOWMEM
+        fLowMem = 1;
+#else
+        fLowMem = 0;
+#endif
+        hashBlock = 0;
+        nHeight = -1;
+        nBlockIndexCount = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nSnapshotVersion);
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(fLowMem);
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nBlockIndexCount);
+    )
+};
+
+// The unspent output state of one transaction in a UTXO snapshot: its coins
+// record and which of its outputs are spent, one bit per output.
+class CSnapshotCoins
+{
+public:
+    uint256 hash;
+    CCoins coins;
+    std::vector<unsigned char> vchSpent;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hash);
+        READWRITE(coins);
+        READWRITE(vchSpent);
+    )
+};
+
+class CAddrIndexCursor;
+class CTxDBCursor;
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -29,12 +331,14 @@
 // Learn more: http://code.google.com/p/leveldb/
 class CTxDB
 {
+    friend class CAddrIndexCursor;
+    friend class CTxDBCursor;
 public:
     CTxDB(const char* pszMode="r+");
     ~CTxDB() {
         // Note that this is not the same as Close() because it deletes only
         // data scoped to this TxDB object.
-        delete activeBatch;
+        delete activeOverlay;
     }
 
     // Destroys the underlying shared global state accessed by this TxDB.
@@ -43,19 +347,57 @@ public:
 private:
     leveldb::DB *pdb;  // Points to the global instance.
 
-    // A batch stores up writes and deletes for atomic application. When this
-    // field is non-NULL, writes/deletes go there instead of directly to disk.
-    leveldb::WriteBatch *activeBatch;
+    // Writes and deletes of the open transaction, keyed by the serialized key
+    // and holding the latest operation for each. When this field is non-NULL,
+    // writes/deletes go here instead of to disk, and reads made while the
+    // transaction is open resolve against it in constant time. TxnCommit
+    // moves them over to the pending changes below.
+    struct CBatchEntry
+    {
+        bool fDeleted;
+        std::string strValue;
+    };
+    typedef boost::unordered_map<std::string, CBatchEntry> BatchOverlay;
+    BatchOverlay *activeOverlay;
+
+    // With -debug=bench, what the lookups in activeOverlay cost, logged by
+    // TxnCommit next to what replaying the batch for each would have cost
+    bool fBenchOverlay;
+    mutable uint64_t nOverlayLookups;
+    mutable int64_t nOverlayLookupTime;
+    mutable uint64_t nOverlayReplayEntries;
+
+    // Changes of committed transactions that have not reached LevelDB yet.
+    // They are shared by all CTxDB instances and held back until the next
+    // commit point, after the block files have been synced, so the database
+    // on disk never refers to block data that a crash could lose.
+    static CCriticalSection cs_pending;
+    static BatchOverlay pendingOverlay;
+    static size_t nPendingBytes;
+
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
 protected:
-    // Returns true and sets (value,false) if activeBatch contains the given key
-    // or leaves value alone and sets deleted = true if activeBatch contains a
+    // Returns true and sets (value,false) if activeOverlay contains the given key
+    // or leaves value alone and sets deleted = true if activeOverlay contains a
     // delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // Same as ScanBatch, for the changes waiting for the next commit point.
+    static bool ScanPending(const CDataStream &key, std::string *value, bool *deleted);
+
+    // Put or delete outside a transaction. While changes are pending this is
+    // queued behind them, so an older pending value cannot overwrite it.
+    bool DirectPut(const std::string &strKey, const std::string &strValue);
+    bool DirectDelete(const std::string &strKey);
+    static void QueuePending(const std::string &strKey, CBatchEntry &entry);
+
+    // Record a put or delete in activeOverlay.
+    void BatchPut(const std::string &strKey, const std::string &strValue);
+    void BatchDelete(const std::string &strKey);
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
@@ -65,15 +407,23 @@ protected:
         std::string strValue;
 
         bool readFromDb = true;
-        if (activeBatch) {
+        if (activeOverlay) {
             // First we must search for it in the currently pending set of
-            // changes to the db. If not found in the batch, go on to read disk.
+            // changes to the db. If not found in the transaction, go on to the
+            // changes waiting for a commit point and then to disk.
             bool deleted = false;
             readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
             if (deleted) {
                 return false;
             }
         }
+        if (readFromDb) {
+            bool deleted = false;
+            readFromDb = ScanPending(ssKey, &strValue, &deleted) == false;
+            if (deleted) {
+                return false;
+            }
+        }
         if (readFromDb) {
             leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
                                               ssKey.str(), &strValue);
@@ -110,16 +460,11 @@ protected:
         ssValue.reserve(10000);
         ssValue << value;
 
-        if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+        if (activeOverlay) {
+            BatchPut(ssKey.str(), ssValue.str());
             return true;
         }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
-        if (!status.ok()) {
-            LogPrintf("LevelDB write failure: %s\n", status.ToString());
-            return false;
-        }
-        return true;
+        return DirectPut(ssKey.str(), ssValue.str());
     }
 
     template<typename K>
@@ -133,12 +478,11 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+        if (activeOverlay) {
+            BatchDelete(ssKey.str());
             return true;
         }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
-        return (status.ok() || status.IsNotFound());
+        return DirectDelete(ssKey.str());
     }
 
     template<typename K>
@@ -149,13 +493,16 @@ protected:
         ssKey << key;
         std::string unused;
 
-        if (activeBatch) {
+        if (activeOverlay) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
+            if (ScanBatch(ssKey, &unused, &deleted)) {
+                return !deleted;
             }
         }
-
+        bool deleted;
+        if (ScanPending(ssKey, &unused, &deleted)) {
+            return !deleted;
+        }
 
         leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
         return status.IsNotFound() == false;
@@ -167,11 +514,17 @@ public:
     bool TxnCommit();
     bool TxnAbort()
     {
-        delete activeBatch;
-        activeBatch = NULL;
+        delete activeOverlay;
+        activeOverlay = NULL;
         return true;
     }
 
+    // Make the changes of committed transactions durable if a commit point
+    // is due, or unconditionally with fForce.
+    bool Commit(bool fForce = false);
+    bool ReadCommitPoint(CCommitPoint& commitPoint);
+    static void GetPendingStats(size_t& nWrites, size_t& nBytes);
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
@@ -183,8 +536,26 @@ public:
         return Write(std::string("version"), nVersion);
     }
 
-    bool ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes);
-    bool WriteAddrIndex(uint160 addrHash, uint256 txHash);
+    bool ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes, unsigned int nSkip = 0, unsigned int nCount = std::numeric_limits<unsigned int>::max());
+    // The last nLast entries of an address, oldest first, cut to nCount
+    bool ReadAddrIndexLast(uint160 addrHash, std::vector<uint256>& txHashes, unsigned int nLast, unsigned int nCount = std::numeric_limits<unsigned int>::max());
+    unsigned int CountAddrIndex(uint160 addrHash);
+    bool WriteAddrIndex(uint160 addrHash, int nHeight, uint256 txHash);
+    bool EraseAddrIndex(uint160 addrHash, int nHeight, uint256 txHash);
+    bool UpgradeAddrIndex();
+    bool WriteAddressUnspent(const CAddressUnspentKey& key, const CAddressUnspentValue& value);
+    bool EraseAddressUnspent(const CAddressUnspentKey& key);
+    bool ReadAddressUnspent(unsigned char addressType, const uint160& addressHash, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent);
+    bool WriteAddressDelta(const CAddressDeltaKey& key, int64_t nDelta);
+    bool EraseAddressDelta(const CAddressDeltaKey& key);
+    bool ReadAddressBalance(unsigned char addressType, const uint160& addressHash, int64_t& nBalance, int64_t& nReceived);
+    bool WriteSpentIndex(const COutPoint& outpoint, const CSpentIndexValue& value);
+    bool EraseSpentIndex(const COutPoint& outpoint);
+    bool ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value);
+    // Drop every entry of the address unspent, address delta and spent indexes
+    bool WipeAddressIndexes();
+    bool ReadFlag(const std::string& strName, bool& fValue);
+    bool WriteFlag(const std::string& strName, bool fValue);
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -194,14 +565,88 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadCoins(uint256 hash, CCoins& coins);
+    bool WriteCoins(uint256 hash, const CCoins& coins);
+    bool EraseCoins(uint256 hash);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadBlockUndo(uint256 hash, CBlockUndo& undo);
+    bool WriteBlockUndo(uint256 hash, const CBlockUndo& undo);
+    bool EraseBlockUndo(uint256 hash);
+    bool UpgradeBlockUndo();
+    bool DumpSnapshot(const std::string& strFile, CSnapshotHeader& header, uint64_t& nCoinsRet, uint256& hashChecksumRet, std::string& strError);
+    bool LoadSnapshot(const std::string& strFile, std::string& strError);
+    bool ReadSnapshotHeader(CSnapshotHeader& header);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
     bool LoadBlockIndex();
+    // Save the block index for a fast start, at shutdown once the database is committed
+    bool WriteBlockIndexSnapshot();
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexSnapshot();
+    bool LoadBlockIndexParallel();
+};
+
+// Walks the keys that start with a prefix in order, or in reverse order, as
+// they would read after the next commit point: a LevelDB snapshot with the
+// changes waiting for that commit point, and those of an open transaction,
+// laid over it.
+// Readers get the same view as Read() without having to force a commit
+// point, and the snapshot keeps them consistent while blocks connect.
+class CTxDBCursor
+{
+public:
+    CTxDBCursor(CTxDB& txdb, const std::string& strPrefixIn, bool fReverseIn = false);
+    ~CTxDBCursor();
+
+    bool Valid() const { return fValid; }
+    void Next();
+
+    const std::string& GetKey() const { return strKey; }
+    const std::string& GetValue() const { return strValue; }
+
+private:
+    leveldb::DB *pdb;
+    const leveldb::Snapshot *psnapshot;
+    leveldb::Iterator *piter;
+    // Overlaid changes under the prefix, in key order
+    typedef std::map<std::string, CTxDB::CBatchEntry> OverlayMap;
+    OverlayMap mapOverlay;
+    OverlayMap::const_iterator itOverlay;
+    std::string strPrefix;
+    std::string strKey;
+    std::string strValue;
+    bool fReverse;
+    bool fValid;
+    bool fFromDb;
+
+    void Settle();
+};
+
+// Iterator over the address index entries of a single address, in chain
+// order or, from the most recent one, in reverse, read through a CTxDBCursor.
+class CAddrIndexCursor
+{
+public:
+    CAddrIndexCursor(CTxDB& txdb, const uint160& addrHashIn, bool fReverse = false);
+    ~CAddrIndexCursor();
+
+    bool Valid() const { return fValid; }
+    void Next();
+    // Skip up to n entries, returns the number actually skipped.
+    unsigned int Skip(unsigned int n);
+
+    const CAddrIndexKey& GetKey() const { return key; }
+
+private:
+    CTxDBCursor cursor;
+    uint160 addrHash;
+    CAddrIndexKey key;
+    bool fValid;
+
+    void ReadKey();
 };
 
 
@@ -24,12 +24,12 @@ private:
 
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTransactionRef> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTransaction &tx);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
@@ -50,6 +50,8 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    /** Shared reference to a pool transaction, or NULL; unlike lookup() it does not copy */
+    CTransactionRef get(const uint256& hash) const;
 };
 
 #endif /* BITCOIN_TXMEMPOOL_H */
@@ -68,6 +68,7 @@ namespace boost {
 #include "shlobj.h"
 #elif defined(__linux__)
 # include <sys/prctl.h>
+# include <fcntl.h>
 #endif
 
 using namespace std;
@@ -1238,6 +1239,38 @@ void FileCommit(FILE *fileout)
 #endif
 }
 
+bool FileSeek(FILE *file, uint64_t nPos)
+{
+#ifdef WIN32
+    return _fseeki64(file, nPos, SEEK_SET) == 0;
+#else
+    if (nPos > (uint64_t)std::numeric_limits<off_t>::max())
+        return false;
+    return fseeko(file, (off_t)nPos, SEEK_SET) == 0;
+#endif
+}
+
+// Reserving without changing the file size keeps appends and the size of the
+// file the same as without it. Elsewhere the filesystem allocates as usual and
+// there is nothing to fail.
+bool AllocateFileRange(FILE *file, uint64_t nOffset, uint64_t nLength)
+{
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    return fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, nOffset, nLength) == 0;
+#else
+    return true;
+#endif
+}
+
+bool ReleaseFileRange(FILE *file, uint64_t nOffset, uint64_t nLength)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    return fallocate(fileno(file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, nOffset, nLength) == 0;
+#else
+    return true;
+#endif
+}
+
 std::string getTimeString(int64_t timestamp, char *buffer, size_t nBuffer)
 {
     struct tm* dt;
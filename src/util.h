@@ -235,6 +235,12 @@ void ParseParameters(int argc, const char*const argv[]);
 bool WildcardMatch(const char* psz, const char* mask);
 bool WildcardMatch(const std::string& str, const std::string& mask);
 void FileCommit(FILE *fileout);
+/** Seek from the start of a file, past 2 GB where the platform allows it */
+bool FileSeek(FILE *file, uint64_t nPos);
+/** Reserve disk space for nLength bytes from nOffset without changing the file size, where supported; errno tells why it failed */
+bool AllocateFileRange(FILE *file, uint64_t nOffset, uint64_t nLength);
+/** Give back space reserved by AllocateFileRange beyond the end of the file */
+bool ReleaseFileRange(FILE *file, uint64_t nOffset, uint64_t nLength);
 bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest);
 boost::filesystem::path GetDefaultDataDir();
 const boost::filesystem::path &GetDataDir(bool fNetSpecific = true);
@@ -1184,6 +1184,16 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
     CBlockIndex* pindex = pindexStart;
     {
         LOCK2(cs_main, cs_wallet);
+
+        // Every main chain block before the first one from our wallet
+        // birthday on is skipped below, so start there directly
+        if (nTimeFirstKey && pindex && pindex->IsInMainChain())
+        {
+            CBlockIndex* pindexFirst = FindBlockByTime(nTimeFirstKey - 7200);
+            if (pindexFirst && pindexFirst->nHeight > pindex->nHeight)
+                pindex = pindexFirst;
+        }
+
         while (pindex)
         {
             // no need to read and scan block, if block was created before
@@ -4622,7 +4632,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;